@@ -0,0 +1,107 @@
+#!/bin/sh
+
+# End-to-end benchmark of setman against the stubs.
+#
+#   ./bench.sh [ITERATIONS] > bench_output.txt
+#
+# Builds an optimized setman, generates command files of several sizes and
+# drives apply -> commit, apply -> timeout -> rollback and forced (-f)
+# cycles. Prints one JSON object per scenario and phase with latency
+# percentiles in milliseconds, as recorded by setman --timings.
+
+set -e
+
+N=${1:-20}
+ROOT=$(cd "$(dirname "$0")" && pwd)
+(cd "$ROOT" && sh ./build.sh release)
+SETMAN="$ROOT/setman"
+
+W=$(mktemp -d)
+trap 'rm -rf "$W"' EXIT
+ln -s "$ROOT/stubs" "$W/stubs"
+cd "$W"
+
+# gen FILE MODE ALLOW USERS VARIANT
+gen() {
+  awk -v mode=$2 -v allow=$3 -v users=$4 -v v=$5 'BEGIN {
+    if(mode == "all" || mode == "net") {
+      printf "ip 10.0.%d.2 255.255.255.0 10.0.%d.1 8.8.8.8 - -\n", v, v
+      for(i = 0; i < allow; i++)
+        printf "allow 10.%d.%d.0 255.255.255.0\n", int(i / 256) % 256, i % 256
+    }
+    if(mode == "all" || mode == "user")
+      for(i = 0; i < users; i++)
+        printf "user u%d p%d.%d\n", i, i, v
+    if(mode == "all") {
+      print "serial /dev/ttyS0 115200"
+      printf "syslog 10.0.%d.5 514\n", v
+    }
+    print "confirm"
+  }' > "$1"
+}
+
+# Waits for the apply in the background (pid $1) to publish its pid file,
+# gives up if it exits first
+wait_pidfile() {
+  while [ ! -f setman.pid ]; do
+    kill -0 $1 2>/dev/null || return 0
+    sleep 0.001
+  done
+}
+
+# run SCENARIO MODE ALLOW USERS
+run() {
+  sc=$1; mode=$2
+  gen cfg0 $2 $3 $4 0
+  gen cfg1 $2 $3 $4 1
+  rm -f setman.state* setman.pid*
+
+  # Every cycle changes the settings: the state is cfg1 between iterations
+  i=0
+  while [ $i -lt $N ]; do
+    cp cfg0 in
+    "$SETMAN" -q -e eth0 -m $mode -f --timings "$sc.force" in >/dev/null 2>&1 || true
+
+    cp cfg1 in
+    "$SETMAN" -q -e eth0 -m $mode -w 10 --timings "$sc.commit" in >/dev/null 2>&1 &
+    wait_pidfile $!
+    "$SETMAN" -q -c >/dev/null 2>&1 || true
+    wait || true
+
+    cp cfg0 in
+    "$SETMAN" -q -e eth0 -m $mode -w 20ms --timings "$sc.rollback" in >/dev/null 2>&1 || true
+
+    i=$((i + 1))
+  done
+
+  for c in force commit rollback; do
+    tr -d '{}"' < "$sc.$c" | awk -F, -v sc="$sc/$c" '{
+      for(i = 1; i <= NF; i++) {
+        split($i, kv, ":")
+        if(kv[1] != "exit" && kv[2] ~ /^[0-9.e+-]+$/)
+          print sc, kv[1], kv[2]
+      }
+    }'
+  done
+}
+
+summarize() {
+  sort -k1,1 -k2,2 -k3,3g | awk '
+    function flush() {
+      if(n == 0) return
+      printf "{\"scenario\":\"%s\",\"phase\":\"%s\",\"n\":%d,\"p50\":%s,\"p90\":%s,\"p99\":%s,\"max\":%s}\n",
+        sc, ph, n, v[pct(0.5)], v[pct(0.9)], v[pct(0.99)], v[n]
+    }
+    function pct(p,  k) { k = int(p * n + 0.999999); return k < 1 ? 1 : k }
+    $1 != sc || $2 != ph { flush(); sc = $1; ph = $2; n = 0 }
+    { v[++n] = $3 }
+    END { flush() }'
+}
+
+{
+  run allow1     all  1     10
+  run allow100   all  100   10
+  run allow10k   all  10000 10
+  run users1k    user 0     1000
+  run net100     net  100   0
+} | summarize
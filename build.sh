@@ -1,3 +1,11 @@
 #!/bin/sh
 
-g++ -std=gnu++11 -g -O0 -include syscmd.h -o setman setman.cpp
+# ./build.sh          debug build
+# ./build.sh release  optimized build (used by bench.sh)
+
+case "$1" in
+  release) FLAGS="-O2 -DNDEBUG" ;;
+  *)       FLAGS="-g -O0" ;;
+esac
+
+g++ -std=gnu++11 $FLAGS -pthread -include syscmd.h -o setman setman.cpp -lcrypt
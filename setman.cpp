@@ -5,12 +5,33 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <memory.h>
+#include <string.h>
 #include <pwd.h>
+#include <crypt.h>
 #include <sys/file.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <time.h>
 #include <syslog.h>
+#include <termios.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <glob.h>
+#include <ifaddrs.h>
+#include <net/route.h>
+#include <sys/signalfd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <ext/stdio_filebuf.h>
 
 #include <sstream>
@@ -18,6 +39,14 @@
 #include <functional>
 #include <cassert>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <regex>
 #include <climits>
@@ -28,36 +57,45 @@ using namespace std::placeholders;
 
 static string g_dmode = "?";
 
-FILE* popen_no_exec(const char *a1, const char* a2) {
-  FILE* f = popen(a1,a2);
-  if(f) {
-    if(fcntl(fileno(f), F_SETFD, FD_CLOEXEC) != 0) {
-      fclose(f);
-      f = NULL;
-    }
-  }
-  return f;
-}
+#define ss(x) (static_cast<std::ostringstream&>(std::ostringstream().flush() << x).str())
 
-static inline std::string mks_(function<void(ostringstream &oss)> f) {
-  ostringstream oss;
-  f(oss);
-  return oss.str();
-}
+/*
+ * Logging. Levels above SETMAN_LOG_MAX compile to nothing, levels above
+ * g_loglevel (-v raises it to LOG_DEBUG) are skipped before anything is
+ * formatted. Messages are formatted into a stack buffer, long ones are
+ * truncated. With SETMAN_LOG_ASYNC they are handed to a ring buffer which
+ * a thread drains to syslog, off the hot path.
+ */
+#ifndef SETMAN_LOG_MAX
+#define SETMAN_LOG_MAX LOG_DEBUG
+#endif
 
-#define ss(x) mks_([&](std::ostringstream &oss){ oss << x ;})
+#ifndef SETMAN_LOG_ASYNC
+#define SETMAN_LOG_ASYNC 0
+#endif
 
 static bool g_haslog = false;
+static int g_loglevel = LOG_NOTICE;
+
+struct logbuf_t : streambuf {
+  logbuf_t() { setp(buf, buf + sizeof(buf) - 1); }
+  const char *c_str() { *pptr() = '\0'; return buf; }
 
-#define dbg_stderr(ss) do{ cerr <<  "setman[" << g_dmode << "]: " << __func__ << ":" <<  __LINE__ << ": " << ss << endl; } while(0)
+  char buf[1024];
+};
+
+void log_emit(int level, const char *func, int line, const char *msg);
 
 #define log(s,x) do{ \
-  if(g_haslog) \
-    syslog(LOG_USER|(x), "%s:%d:%s", __func__, __LINE__, ss(s).c_str()); \
-  else \
-    dbg_stderr(s); \
+  if((x) <= SETMAN_LOG_MAX && (x) <= g_loglevel) { \
+    logbuf_t _lb; \
+    ostream _lo(&_lb); \
+    _lo << s; \
+    log_emit((x), __func__, __LINE__, _lb.c_str()); \
+  } \
   } while(0)
 
+#define trace(s) log(s,LOG_DEBUG)
 #define dbg(s) log(s,LOG_NOTICE)
 #define err(s) log(s,LOG_ERR)
 
@@ -126,14 +164,141 @@ public:
   throw_if(nam == NULL); \
   atret( free(nam); );
 
+/* Bounded queue of formatted messages, drained to syslog by a thread.
+ * When it's full messages are dropped and counted, never waited for */
+struct logring_t {
+  logring_t() : head(0), tail(0), dropped(0), started(false), stop(false) {}
+
+  ~logring_t() { flush(); }
+
+  void push(int level, const char *func, int line, const char *msg) {
+    unique_lock<mutex> l(mtx);
+    if(!started) {
+      /* The drainer inherits a fully blocked mask, so signals are left to
+       * the main thread (see wait_commit) */
+      sigset_t all, old;
+      sigfillset(&all);
+      pthread_sigmask(SIG_SETMASK, &all, &old);
+      drainer = thread([this]() { drain(); });
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+      started = true;
+    }
+    if(head - tail == SIZE) {
+      dropped++;
+      return;
+    }
+    entry_t &e = ring[head++ % SIZE];
+    e.level = level;
+    snprintf(e.text, sizeof(e.text), "%s:%d:%s", func, line, msg);
+    cv.notify_one();
+  }
+
+  /* Waits until everything queued so far is written */
+  void flush() {
+    {
+      lock_guard<mutex> l(mtx);
+      if(!started)
+        return;
+      stop = true;
+      cv.notify_one();
+    }
+    drainer.join();
+    started = stop = false;
+  }
+
+private:
+  void drain() {
+    unique_lock<mutex> l(mtx);
+    for(;;) {
+      cv.wait(l, [this]() { return stop || head != tail; });
+      if(dropped) {
+        syslog(LOG_USER|LOG_ERR, "log:%u messages dropped", dropped);
+        dropped = 0;
+      }
+      if(head == tail) {
+        if(stop)
+          return;
+        continue;
+      }
+      entry_t e = ring[tail++ % SIZE];
+      l.unlock();
+      syslog(LOG_USER|e.level, "%s", e.text);
+      l.lock();
+    }
+  }
+
+  enum { SIZE = 256 };
+  struct entry_t {
+    int level;
+    char text[512];
+  };
+
+  entry_t ring[SIZE];
+  size_t head, tail;
+  unsigned dropped;
+  bool started, stop;
+  mutex mtx;
+  condition_variable cv;
+  thread drainer;
+};
+
+static logring_t g_logring;
+
+void log_emit(int level, const char *func, int line, const char *msg) {
+  if(!g_haslog)
+    fprintf(stderr, "setman[%s]: %s:%d: %s\n", g_dmode.c_str(), func, line, msg);
+  else if(SETMAN_LOG_ASYNC)
+    g_logring.push(level, func, line, msg);
+  else
+    syslog(LOG_USER|level, "%s:%d:%s", func, line, msg);
+}
+
 #define DEFAULT_WAIT 10
+#define DEFAULT_LOCK_WAIT 3
+#define DEFAULT_THREADS 4
+
+#ifndef SETMAN_NETLINK
+#define SETMAN_NETLINK 1
+#endif
+
+#ifndef SETMAN_SERIAL_NATIVE
+#define SETMAN_SERIAL_NATIVE 1
+#endif
+
+#ifndef SETMAN_USERS_NATIVE
+#define SETMAN_USERS_NATIVE 1
+#endif
+
+/* Users are provisioned under SETMAN_ROOT/etc, "" is the real /etc */
+#ifndef SETMAN_ROOT
+#define SETMAN_ROOT ""
+#endif
+
+/* Subsystems, one per with_* handler */
+typedef enum {
+  sub_net = 1,
+  sub_user = 2,
+  sub_serial = 4,
+  sub_syslog = 8,
+  sub_time = 16,
+  sub_all = 31
+} subsys_t;
+
+struct snapshot_t;
 
 struct args {
-  args() : wait_sec(DEFAULT_WAIT), force(false) {}
+  args() : wait_ms(DEFAULT_WAIT * 1000L), lock_ms(DEFAULT_LOCK_WAIT * 1000L),
+    force(false), full(false), converge(false), subsys(sub_all), live(NULL) {}
 
   string eth;
-  int wait_sec;
+  long wait_ms;
+  long lock_ms;
   bool force;
+  bool full;
+  bool converge;    /* only issue what differs from the live settings */
+  unsigned subsys;  /* subsystems to apply, the rest is only checked */
+  string scope;     /* suffix of per-interface files, see iface_scope() */
+  const snapshot_t *live;  /* live settings to converge from, if any */
 };
 
 bool ip_enabled(const string ip) {
@@ -142,518 +307,3833 @@ bool ip_enabled(const string ip) {
   return true;
 }
 
-string spc(const string &s) {
-  return string(" " + s + " ");
-}
+/*
+ * Executor. Commands are argv vectors which are spawned directly (no shell
+ * involved). Child stdout/stderr are captured over pipes, optional input is
+ * fed to the child's stdin. Several children may run at once.
+ */
+
+typedef vector<string> argv_t;
 
-void ip_check(const string &ip) {
-  if(ip == "-")
-    return; /* means 'disabled' */
-  int a=0,b=0,c=0,d=0;
-  char buf[256];
-  sscanf(ip.c_str(),"%d.%d.%d.%d", &a,&b,&c,&d);
-  snprintf(buf, 256, "%d.%d.%d.%d", a,b,c,d);
-  throw_if( ip != buf );
+struct cmd_t {
+  cmd_t(const argv_t &argv_) : argv(argv_) {}
+  cmd_t(const argv_t &argv_, const string &input_) : argv(argv_), input(input_) {}
+
+  argv_t argv;
+  string input;
+};
+
+struct execres_t {
+  execres_t() : pid(-1), status(0), ec(-1), ms(0) {}
+
+  argv_t argv;
+  pid_t pid;
+  int status;     /* waitpid() status */
+  int ec;         /* exit code, -1 if the child was killed by a signal */
+  string out;
+  string errout;
+  double ms;      /* wall time from spawn to exit */
+};
+
+static string join(const argv_t &argv) {
+  string r;
+  for(const string &w : argv) {
+    if(!r.empty())
+      r += " ";
+    r += w;
+  }
+  return r;
 }
 
-void sys(string s) {
-  int ret = system(s.c_str());
-  int ec = WEXITSTATUS(ret);
-  dbg("\"" << s << "\" ret " << ret << " ec " << ec);
-  throw_if(ec != 0);
+static double ms_since(const struct timespec &t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
 }
 
-typedef enum{dryrun,force} cmdmode_t;
-typedef function<bool(string,istream&)> fchecker_t;
+static int pidfd_open_(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
 
-void with_ip(cmdmode_t mode, const args &a, function< void( fchecker_t ) > f) {
+struct proc_t {
+  proc_t() : infd(-1), outfd(-1), errfd(-1), pfd(-1), inoff(0), done(false) {}
 
-  if(mode == force) {
+  execres_t r;
+  string input;
+  int infd, outfd, errfd, pfd;
+  size_t inoff;
+  bool done;
+  struct timespec t0;
+};
 
-    /* Kill dhcpc (if any) */
-    fstream dhcppid(SETMAN_DHCPPID, ios_base::in);
-    int pid = 0;
-    if(dhcppid >> pid && pid > 0) {
-      int ret = kill(pid, SIGUSR2);
-      if(ret != 0)
-        dbg("failed to send SIGUSR2 to " << pid);
-      usleep(500 * 1000); /* 0.5 sec */
-      ret = kill(pid, SIGINT);
-      if(ret != 0)
-        dbg("Failed to send SIGINT to " << pid);
-      ret = kill(pid, SIGKILL);
-      if(ret != 0)
-        dbg("Failed to send SIGKILL to " << pid);
-    }
-    else {
-      dbg("Error accessing " << SETMAN_DHCPPID << " (file doesn't exist?)");
-    }
+static void closefd(int &fd) {
+  if(fd >= 0)
+    close(fd);
+  fd = -1;
+}
 
-    /* Reset the interface */
-    sys( ss(SETMAN_IFCONFIG << spc(a.eth) << " down" ) );
+static void spawn(proc_t &p, const cmd_t &c) {
+  int pin[2], pout[2], perr[2];
+  throw_if(c.argv.empty());
+  throw_if(0 != pipe2(pin, O_CLOEXEC));
+  throw_if(0 != pipe2(pout, O_CLOEXEC));
+  throw_if(0 != pipe2(perr, O_CLOEXEC));
+
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  atret( posix_spawn_file_actions_destroy(&fa) );
+  posix_spawn_file_actions_adddup2(&fa, pin[0], 0);
+  posix_spawn_file_actions_adddup2(&fa, pout[1], 1);
+  posix_spawn_file_actions_adddup2(&fa, perr[1], 2);
+
+  /* Children start with default signal dispositions and an empty mask */
+  posix_spawnattr_t sa;
+  posix_spawnattr_init(&sa);
+  atret( posix_spawnattr_destroy(&sa) );
+  sigset_t none, def;
+  sigemptyset(&none);
+  sigemptyset(&def);
+  sigaddset(&def, SIGPIPE);
+  sigaddset(&def, SIGINT);
+  sigaddset(&def, SIGHUP);
+  sigaddset(&def, SIGUSR1);
+  posix_spawnattr_setsigmask(&sa, &none);
+  posix_spawnattr_setsigdefault(&sa, &def);
+  posix_spawnattr_setflags(&sa, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  vector<char*> argv;
+  for(const string &w : c.argv)
+    argv.push_back(const_cast<char*>(w.c_str()));
+  argv.push_back(NULL);
+
+  p.r.argv = c.argv;
+  p.input = c.input;
+  clock_gettime(CLOCK_MONOTONIC, &p.t0);
+  int ret = posix_spawnp(&p.r.pid, argv[0], &fa, &sa, argv.data(), environ);
+
+  close(pin[0]);
+  close(pout[1]);
+  close(perr[1]);
+  p.infd = pin[1];
+  p.outfd = pout[0];
+  p.errfd = perr[0];
+
+  if(ret != 0) {
+    closefd(p.infd);
+    closefd(p.outfd);
+    closefd(p.errfd);
+    errno = ret;
+    throw_("Failed to spawn '" << join(c.argv) << "'");
+  }
 
-    /* Reset the iptables */
-    sys(SETMAN_IPTABLES " -P INPUT DROP");
-    sys(SETMAN_IPTABLES " -P OUTPUT ACCEPT");
-    sys(SETMAN_IPTABLES " -P FORWARD DROP");
+  fcntl(p.infd, F_SETFL, O_NONBLOCK);
+  fcntl(p.outfd, F_SETFL, O_NONBLOCK);
+  fcntl(p.errfd, F_SETFL, O_NONBLOCK);
+  if(p.input.empty())
+    closefd(p.infd);
 
-    sys(SETMAN_IPTABLES " -F");
-    sys(SETMAN_IPTABLES " -X");
+  /* pidfd lets us notice the exit even if a daemonized grandchild keeps
+   * the output pipes open */
+  p.pfd = pidfd_open_(p.r.pid);
+}
 
-    sys(SETMAN_IPTABLES " -A INPUT -i lo -j ACCEPT");
-    sys(SETMAN_IPTABLES " -A INPUT -p ICMP -j ACCEPT");
-    sys(SETMAN_IPTABLES " -A INPUT -p TCP -m state --state ESTABLISHED,RELATED -j ACCEPT");
-    sys(SETMAN_IPTABLES " -A INPUT -p udp --sport 53 --dport 1024:65535 -m state --state ESTABLISHED -j ACCEPT");
-    sys(SETMAN_IPTABLES " -A INPUT -p udp --sport 123 -j ACCEPT");
+static void drain(int &fd, string &buf) {
+  char tmp[4096];
+  while(fd >= 0) {
+    ssize_t n = read(fd, tmp, sizeof(tmp));
+    if(n > 0)
+      buf.append(tmp, n);
+    else if(n < 0 && errno == EINTR)
+      continue;
+    else {
+      if(n == 0 || errno != EAGAIN)
+        closefd(fd);
+      break;
+    }
   }
+}
 
-  f([&](string cmd, istream &s) {
-
-    if(cmd == "dhcp") {
+static bool reap(proc_t &p) {
+  int st;
+  pid_t ret = waitpid(p.r.pid, &st, WNOHANG);
+  if(ret == 0 || (ret < 0 && errno == EINTR))
+    return false;
+  p.r.status = (ret == p.r.pid) ? st : -1;
+  p.r.ec = (ret == p.r.pid && WIFEXITED(st)) ? WEXITSTATUS(st) : -1;
+  p.r.ms = ms_since(p.t0);
+  drain(p.outfd, p.r.out);
+  drain(p.errfd, p.r.errout);
+  closefd(p.infd);
+  closefd(p.outfd);
+  closefd(p.errfd);
+  closefd(p.pfd);
+  p.done = true;
+  return true;
+}
 
-      if(mode == dryrun)
-        return true;
+vector<execres_t> execute(const vector<cmd_t> &cmds) {
 
-      sys( SETMAN_DHCP );
+  /* Writing to a child which has gone away must not raise SIGPIPE. The
+   * disposition is process wide, the last concurrent caller restores it */
+  static mutex pipe_mtx;
+  static int pipe_users = 0;
+  static struct sigaction pipe_old;
+  {
+    lock_guard<mutex> l(pipe_mtx);
+    if(pipe_users++ == 0) {
+      struct sigaction ign;
+      memset(&ign, 0, sizeof(struct sigaction));
+      ign.sa_handler = SIG_IGN;
+      sigemptyset(&ign.sa_mask);
+      sigaction(SIGPIPE, &ign, &pipe_old);
+    }
+  }
+  atret(
+    lock_guard<mutex> l(pipe_mtx);
+    if(--pipe_users == 0)
+      sigaction(SIGPIPE, &pipe_old, NULL);
+  );
+
+  vector<proc_t> ps(cmds.size());
+  atret(
+    for(proc_t &p : ps) {
+      if(!p.done && p.r.pid > 0) {
+        kill(p.r.pid, SIGKILL);
+        waitpid(p.r.pid, NULL, 0);
+      }
+      closefd(p.infd); closefd(p.outfd); closefd(p.errfd); closefd(p.pfd);
     }
-    else if( cmd == "ip" ) {
-      string ip, mask, gw, dns1, dns2, dns3, e;
-      s >> ip >> mask >> gw >> dns1 >> dns2 >> dns3;
-      throw_if( s >> e );
+  );
 
-      ip_check(ip);
-      ip_check(mask);
-      ip_check(gw);
+  for(size_t i = 0; i < cmds.size(); i++)
+    spawn(ps[i], cmds[i]);
 
-      if(mode == force) {
+  for(;;) {
+    vector<struct pollfd> fds;
+    bool tick = false;
+    size_t alive = 0;
 
-        sys( ss(SETMAN_IFCONFIG << spc(a.eth) << " up ") );
+    for(proc_t &p : ps) {
+      if(p.done || reap(p))
+        continue;
+      alive++;
+      if(p.infd >= 0)
+        fds.push_back({p.infd, POLLOUT, 0});
+      if(p.outfd >= 0)
+        fds.push_back({p.outfd, POLLIN, 0});
+      if(p.errfd >= 0)
+        fds.push_back({p.errfd, POLLIN, 0});
+      if(p.pfd >= 0)
+        fds.push_back({p.pfd, POLLIN, 0});
+      else
+        tick = true;
+    }
 
-        sys( ss(SETMAN_IFCONFIG << spc(a.eth) << spc(ip) << " netmask " << spc(mask) ));
+    if(alive == 0)
+      break;
 
-        if(gw != "-" && gw != "0.0.0.0") {
-          sys( ss(SETMAN_ROUTE << " add default gateway " << spc(gw) ));
-        }
+    int ret = poll(fds.data(), fds.size(), tick ? 10 : -1);
+    throw_if(ret < 0 && errno != EINTR);
 
-        bool moved = false;
-        const char *tmp = SETMAN_RESOLVCONF ".new";
-        const char *fin = SETMAN_RESOLVCONF;
-        FILE* f = fopen(tmp, "we");
-        throw_if(f == NULL);
-        atret( if(f) fclose(f) );
-        atret( if(!moved) remove(tmp) );
+    for(proc_t &p : ps) {
+      if(p.done)
+        continue;
+      if(p.infd >= 0) {
+        ssize_t n = write(p.infd, p.input.data() + p.inoff, p.input.size() - p.inoff);
+        if(n > 0)
+          p.inoff += n;
+        if((n < 0 && errno != EAGAIN && errno != EINTR) || p.inoff == p.input.size())
+          closefd(p.infd);
+      }
+      drain(p.outfd, p.r.out);
+      drain(p.errfd, p.r.errout);
+    }
+  }
 
-        if(ip_enabled(dns1)) {
-          fprintf(f, "nameserver %s\n", dns1.c_str());
-        }
+  vector<execres_t> res;
+  for(proc_t &p : ps)
+    res.push_back(p.r);
+  return res;
+}
 
-        if(ip_enabled(dns2)) {
-          fprintf(f, "nameserver %s\n", dns2.c_str());
-        }
+execres_t execute(const cmd_t &c) {
+  return execute(vector<cmd_t>(1, c))[0];
+}
 
-        if(ip_enabled(dns3)) {
-          fprintf(f, "nameserver %s\n", dns3.c_str());
-        }
+/*
+ * Process supervision. stop_process() sends the signals of an escalation
+ * in turn and returns as soon as the process exits, waiting at most
+ * wait_ms after each signal. The exit is observed through a pidfd; without
+ * pidfd_open() the process is polled with waitpid() (our children) or its
+ * /proc entry (others).
+ */
+struct escalation_t {
+  int signo;
+  long wait_ms;
+};
 
-        throw_if( 0 != fclose(f) );
-        f = NULL;
+static bool has_exited(pid_t pid) {
+  int st;
+  pid_t r = waitpid(pid, &st, WNOHANG);
+  if(r == pid)
+    return true;
+  if(r == 0)
+    return false;
+  /* Not our child */
+  ifstream f(ss("/proc/" << pid << "/stat"));
+  string p, comm, state;
+  if(!(f >> p >> comm >> state))
+    return true;
+  return state == "Z" || state == "X";
+}
 
-        throw_if( 0 != rename(tmp, fin) );
-        moved = true;
-      }
+static bool wait_exit(pid_t pid, int pfd, long wait_ms) {
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(;;) {
+    long left = wait_ms - (long)ms_since(t0);
+    if(pfd >= 0) {
+      struct pollfd p = { pfd, POLLIN, 0 };
+      int ret = poll(&p, 1, left > 0 ? left : 0);
+      if(ret > 0)
+        return true;
+      if(ret < 0 && errno == EINTR)
+        continue;
+      if(ret < 0 || left <= 0)
+        return false;
     }
-    else if(cmd == "off") {
-      string e;
-      throw_if( s >> e );
-      /* no args, do nothing */
+    else {
+      if(has_exited(pid))
+        return true;
+      if(left <= 0)
+        return false;
+      usleep(left < 2 ? left * 1000 : 2000);
     }
-    else if(cmd == "allow") {
-      string ip, mask, e;
-      throw_if_not( s >> ip >> mask );
-      throw_if( s >> e );
+  }
+}
 
-      ip_check(ip);
-      ip_check(mask);
+bool stop_process(pid_t pid, const vector<escalation_t> &steps) {
+  int pfd = pidfd_open_(pid);
+  if(pfd < 0 && errno == ESRCH) {
+    dbg("Process " << pid << " doesn't exist");
+    return true;
+  }
+  atret( if(pfd >= 0) close(pfd) );
 
-      if(mode == force) {
-        if(mask == "0.0.0.0") {
-          sys( ss(SETMAN_IPTABLES << " -A INPUT -j ACCEPT"));
-        }
-        else {
-          sys( ss(SETMAN_IPTABLES << " -A INPUT -s '" << ip << "/" << mask << "' -j ACCEPT"));
-        }
-      }
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(const escalation_t &e : steps) {
+    if(kill(pid, e.signo) != 0) {
+      if(errno == ESRCH)
+        break;
+      dbg("Failed to send signal " << e.signo << " to " << pid);
     }
-    else {
-      return false;
+    if(wait_exit(pid, pfd, e.wait_ms)) {
+      dbg("Process " << pid << " exited after signal " << e.signo << " (" << ms_since(t0) << " ms)");
+      waitpid(pid, NULL, WNOHANG);
+      return true;
     }
-
-    return true;
-  });
+  }
+  return has_exited(pid);
 }
 
-void with_user(cmdmode_t mode, const args &a, function< void( fchecker_t ) > f) {
+/*
+ * Metrics: counters and latency histograms of executed commands ("cmd:"),
+ * handlers ("handler:"), apply phases ("phase:") and runs ("run:").
+ * They are merged into SETMAN_METRICS at exit, so they accumulate across
+ * runs; 'setman -s --metrics' prints them.
+ */
+#define METRIC_BUCKETS 16
+
+/* Upper bounds (ms) of the histogram buckets, the last one is open */
+static const double metric_bounds[METRIC_BUCKETS - 1] = {
+  0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
 
-  FILE *pp = NULL;
+struct metric_t {
+  metric_t() : count(0), errors(0), sum_ms(0), max_ms(0) {
+    memset(buckets, 0, sizeof(buckets));
+  }
 
-  if(mode == force) {
-    pp = popen_no_exec(SETMAN_UPWD, "we");
-    throw_if(pp == NULL);
+  void add(double ms, bool error) {
+    count++;
+    errors += error;
+    sum_ms += ms;
+    max_ms = max(max_ms, ms);
+    int b = 0;
+    while(b < METRIC_BUCKETS - 1 && ms > metric_bounds[b])
+      b++;
+    buckets[b]++;
   }
 
-  f([&](string cmd, istream &s) {
+  void merge(const metric_t &o) {
+    count += o.count;
+    errors += o.errors;
+    sum_ms += o.sum_ms;
+    max_ms = max(max_ms, o.max_ms);
+    for(int b = 0; b < METRIC_BUCKETS; b++)
+      buckets[b] += o.buckets[b];
+  }
 
-    if (cmd == "user") {
-      string usr, pwd, e;
-      s >> usr >> pwd;
-      throw_if( s >> e );
+  /* Upper bound of the bucket holding the p-th quantile */
+  double quantile(double p) const {
+    uint64_t seen = 0;
+    for(int b = 0; b < METRIC_BUCKETS; b++) {
+      seen += buckets[b];
+      if(seen > 0 && seen >= p * count)
+        return b < METRIC_BUCKETS - 1 ? min(metric_bounds[b], max_ms) : max_ms;
+    }
+    return max_ms;
+  }
 
-      if(pp)
-        fprintf(pp,"%s %s\n", usr.c_str(), pwd.c_str());
+  uint64_t count;
+  uint64_t errors;
+  double sum_ms;
+  double max_ms;
+  uint64_t buckets[METRIC_BUCKETS];
+};
 
-      return true;
-    }
+typedef map<string, metric_t> metrics_map_t;
+
+/* File format: one 'KEY COUNT ERRORS SUM MAX B0 .. B15' line per metric */
+static void read_metrics(istream &s, metrics_map_t &m) {
+  string line;
+  while(getline(s, line)) {
+    istringstream l(line);
+    string key;
+    metric_t r;
+    if(!(l >> key >> r.count >> r.errors >> r.sum_ms >> r.max_ms))
+      continue;
+    for(int b = 0; b < METRIC_BUCKETS; b++)
+      l >> r.buckets[b];
+    if(l)
+      m[key].merge(r);
+  }
+}
 
-    return false;
+struct metrics_t {
 
-  });
+  void add(const string &key, double ms, bool error) {
+    lock_guard<mutex> l(mtx);
+    string k = key;
+    replace(k.begin(), k.end(), ' ', '/');
+    m[k].add(ms, error);
+  }
 
-  if(pp) pclose(pp);
-}
+  /* Merge the metrics collected so far into the metrics file */
+  void flush() {
+    metrics_map_t cur;
+    {
+      lock_guard<mutex> l(mtx);
+      cur.swap(m);
+    }
+    if(cur.empty())
+      return;
 
-void with_serial(cmdmode_t mode, const args &a, function< void( fchecker_t ) > f) {
+    int fd = open(SETMAN_METRICS, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) {
+      err("Failed to open " << SETMAN_METRICS);
+      return;
+    }
+    atret( close(fd) );
+    flock(fd, LOCK_EX);
+
+    ifstream in(SETMAN_METRICS);
+    read_metrics(in, cur);
+
+    ostringstream oss;
+    oss.precision(6);
+    for(const auto &i : cur) {
+      const metric_t &r = i.second;
+      oss << i.first << " " << r.count << " " << r.errors << " " << fixed << r.sum_ms << " " << r.max_ms;
+      for(int b = 0; b < METRIC_BUCKETS; b++)
+        oss << " " << r.buckets[b];
+      oss << "\n";
+    }
 
-  if(mode == force) {
+    string data = oss.str();
+    if(0 != ftruncate(fd, 0) || pwrite(fd, data.data(), data.size(), 0) != (ssize_t)data.size())
+      err("Failed to write " << SETMAN_METRICS);
   }
 
-  f([&](string cmd, istream &s) {
-    if (cmd == "serial") {
-      string line;
-      getline(s, line);
+  mutex mtx;
+  metrics_map_t m;
+};
 
-      if(mode == force) {
+static metrics_t g_metrics;
 
-        sys( ss(SETMAN_SERIAL << " " << line) );
+/* Prints the persisted metrics, one line per key */
+void dump_metrics(ostream &o) {
+  metrics_map_t m;
+  ifstream f(SETMAN_METRICS);
+  read_metrics(f, m);
 
-      }
-    }
-    else {
-      return false;
-    }
+  o << "# key count errors avg_ms max_ms p50_ms p90_ms p99_ms" << endl;
+  for(const auto &i : m) {
+    const metric_t &r = i.second;
+    o << i.first << " " << r.count << " " << r.errors << " "
+      << (r.count ? r.sum_ms / r.count : 0) << " " << r.max_ms << " "
+      << r.quantile(0.5) << " " << r.quantile(0.9) << " " << r.quantile(0.99) << endl;
+  }
+}
 
-    return true;
-  });
+/* Metric key of a command: program name and its first argument */
+static string cmd_key(const argv_t &argv) {
+  string k = argv[0].substr(argv[0].rfind('/') + 1);
+  if(argv.size() > 1)
+    k += " " + argv[1];
+  return "cmd:" + k;
 }
 
+static void log_output(const string &out) {
+  istringstream s(out);
+  string l;
+  while(getline(s, l))
+    trace("> " << l);
+}
 
-void with_syslog(cmdmode_t mode, const args &a, function< void ( fchecker_t ) > f) {
+/* Run a command, fail if it fails. Returns its stdout */
+string sys_out(const argv_t &argv, const string &input = string()) {
+  execres_t r = execute(cmd_t(argv, input));
+  g_metrics.add(cmd_key(r.argv), r.ms, r.ec != 0);
+  log_output(r.errout);
+  dbg("\"" << join(r.argv) << "\" ret " << r.status << " ec " << r.ec << " (" << r.ms << " ms)");
+  throw_if(r.ec != 0);
+  return r.out;
+}
 
-  int nsyslog = 0;
+void sys(const argv_t &argv, const string &input = string()) {
+  log_output(sys_out(argv, input));
+}
 
-  if(mode == force) {
-    sys( ss(SETMAN_SYSLOG) );
+/* Run independent commands concurrently, fail if any of them fails */
+void sys_all(const vector<cmd_t> &cs) {
+  bool failed = false;
+  for(const execres_t &r : execute(cs)) {
+    g_metrics.add(cmd_key(r.argv), r.ms, r.ec != 0);
+    log_output(r.out);
+    log_output(r.errout);
+    dbg("\"" << join(r.argv) << "\" ret " << r.status << " ec " << r.ec << " (" << r.ms << " ms)");
+    failed |= (r.ec != 0);
   }
+  throw_if(failed);
+}
+
+static int open_lockfile(const string &lf) {
+  int lockfd = open ( lf.c_str(), O_RDONLY | O_NOCTTY | O_NOFOLLOW | O_CREAT | O_CLOEXEC, 0666 );
+  throw_if(lockfd < 0);
+  return lockfd;
+}
 
-  f([&](string cmd, istream &s) {
-    if (cmd == "syslog") {
-      int port;
-      string host, e;
-      s >> host >> port;
+/*
+ * Firewall ruleset of the filter table. Built in memory and committed in a
+ * single SETMAN_IPTABLES_RESTORE call, which replaces the whole table
+ * atomically (no half-built firewall, one spawn regardless of its size).
+ *
+ * A ruleset scoped to an interface owns only its chain, entered from INPUT
+ * for packets of that interface. The chain is merged into the current
+ * table, so interfaces configured concurrently keep each other's rules.
+ */
+struct ruleset_t {
+
+  void scope(const string &chain_, const string &iface_) {
+    chain = chain_;
+    iface = iface_;
+  }
 
-      throw_if( s >> e );
-      ip_check(host);
+  void policy(const string &chain, const string &target) {
+    for(auto &p : policies) {
+      if(p.first == chain) {
+        p.second = target;
+        return;
+      }
+    }
+    policies.push_back(make_pair(chain, target));
+  }
 
-      if(nsyslog < 2) {
+  void append(const string &chain, const argv_t &rule) {
+    rules.push_back(make_pair(chain, rule));
+  }
 
-        if(ip_enabled(host)) {
+  /* iptables-save format */
+  string render() const {
+    ostringstream oss;
+    oss << "*filter\n";
+    for(const auto &p : policies)
+      oss << ":" << p.first << " " << p.second << " [0:0]\n";
+    for(const auto &r : rules)
+      oss << "-A " << r.first << " " << join(r.second) << "\n";
+    oss << "COMMIT\n";
+    return oss.str();
+  }
 
-          if(mode == force) {
-            sys( ss(SETMAN_SYSLOG << " -R " << host << ":" << port) );
-          }
-        }
+  /* Rules of INPUT bound to an interface (like the loopback one) never
+   * match in the chain, they stay in INPUT */
+  void split(vector<string> &input, vector<string> &own) const {
+    for(const auto &r : rules) {
+      string l = "-A " + r.first + " " + join(r.second);
+      if(r.first == "INPUT" && r.second.size() > 0 && r.second[0] == "-i")
+        input.push_back(l);
+      else if(r.first == "INPUT")
+        own.push_back("-A " + chain + " " + join(r.second));
+      else
+        input.push_back(l);
+    }
+  }
+
+  void commit() const {
+    dbg("Committing ruleset of " << rules.size() << " rules");
+    if(chain.empty()) {
+      sys({ SETMAN_IPTABLES_RESTORE }, render());
+      return;
+    }
+
+    vector<string> input, own;
+    split(input, own);
+    commit_chain(chain, iface, &own, policies, input);
+  }
 
-        nsyslog++;
+  /* Chain declarations (without counters) and rules of an iptables-save
+   * dump */
+  static void parse_dump(const string &dump, vector< pair<string, string> > &chains, vector<string> &lines) {
+    istringstream in(dump);
+    string l;
+    while(getline(in, l)) {
+      if(l.size() > 1 && l[0] == ':') {
+        istringstream ls(l.substr(1));
+        string name, target;
+        ls >> name >> target;
+        chains.push_back(make_pair(name, target));
       }
-      else {
-        throw_("only one syslog server is supported at the moment");
+      else if(l.compare(0, 3, "-A ") == 0) {
+        lines.push_back(l);
       }
     }
-    else {
-      return false;
-    }
+  }
 
-    return true;
-  });
+  /* Whether committing would leave the table dumped in dump as it is. The
+   * comparison is textual, so rules are appended in the canonical spelling
+   * of iptables-save (lower case protocols, implicit matches like '-m udp'
+   * spelled out, addresses with their prefix length); a rule spelled
+   * differently only costs a needless commit */
+  bool in_effect(const string &dump) const {
+    vector< pair<string, string> > chains;
+    vector<string> lines;
+    parse_dump(dump, chains, lines);
+
+    auto target = [&](const string &name) -> string {
+      for(const auto &c : chains) {
+        if(c.first == name)
+          return c.second;
+      }
+      return "";
+    };
 
-}
+    for(const auto &p : policies) {
+      if(target(p.first) != p.second)
+        return false;
+    }
 
-void with_time(cmdmode_t mode, const args &a, function< void ( fchecker_t ) > f) {
+    if(chain.empty()) {
+      /* The restore drops chains of anybody else */
+      vector<string> want;
+      for(const auto &r : rules)
+        want.push_back("-A " + r.first + " " + join(r.second));
+      return chains.size() == policies.size() && lines == want;
+    }
 
-  f([&](string cmd, istream &s) {
-    if (cmd == "time") {
-      time_t sec;
-      suseconds_t usec;
-      string e;
-      throw_if_not( s >> sec >> usec );
-      throw_if( s >> e );
+    vector<string> input, own, have;
+    split(input, own);
+    input.push_back("-A INPUT -i " + iface + " -j " + chain);
+    for(const string &e : input) {
+      if(find(lines.begin(), lines.end(), e) == lines.end())
+        return false;
+    }
+    for(const string &l : lines) {
+      if(l.compare(0, 4 + chain.size(), "-A " + chain + " ") == 0)
+        have.push_back(l);
+    }
+    return target(chain) != "" && have == own;
+  }
 
-      if(mode == force) {
-        struct timeval tv;
-        memset(&tv, 0, sizeof(struct timeval));
-        tv.tv_sec = sec;
-        tv.tv_usec = usec;
+  /* Replaces the rules of chain (or drops it, if own is NULL) in the
+   * current table. Policies and extra rules are merged in as well */
+  static void commit_chain(const string &chain, const string &iface, const vector<string> *own,
+                           const vector< pair<string, string> > &policies, const vector<string> &extra) {
+    int lockfd = open_lockfile(SETMAN_LOCKFILE ".fw");
+    atret( close(lockfd) );
+    throw_if( 0 != flock(lockfd, LOCK_EX) );
+
+    string jump = "-A INPUT -i " + iface + " -j " + chain;
+    vector< pair<string, string> > chains;
+    vector<string> lines;
+
+    vector< pair<string, string> > all;
+    vector<string> all_lines;
+    parse_dump(sys_out({ SETMAN_IPTABLES_SAVE, "-t", "filter" }), all, all_lines);
+    for(const auto &c : all) {
+      if(c.first != chain)
+        chains.push_back(c);
+    }
+    for(const string &l : all_lines) {
+      if(l != jump && l.compare(0, 4 + chain.size(), "-A " + chain + " ") != 0)
+        lines.push_back(l);
+    }
 
-        throw_if(0 != settimeofday(&tv, NULL));
-        sys( ss(SETMAN_HWCLOCK << " -w") );
+    if(own) {
+      for(const auto &p : policies) {
+        bool found = false;
+        for(auto &c : chains) {
+          if(c.first == p.first) {
+            c.second = p.second;
+            found = true;
+          }
+        }
+        if(!found)
+          chains.push_back(p);
+      }
+      chains.push_back(make_pair(chain, string("-")));
 
+      for(const string &e : extra) {
+        if(find(lines.begin(), lines.end(), e) == lines.end())
+          lines.insert(lines.begin(), e);
       }
-    }
-    else {
-      return false;
+      lines.push_back(jump);
+      lines.insert(lines.end(), own->begin(), own->end());
     }
 
-    return true;
-  });
+    ostringstream oss;
+    oss << "*filter\n";
+    for(const auto &c : chains)
+      oss << ":" << c.first << " " << c.second << " [0:0]\n";
+    for(const string &r : lines)
+      oss << r << "\n";
+    oss << "COMMIT\n";
+
+    dbg("Committing chain " << chain << " of " << (own ? own->size() : 0) << " rules");
+    sys({ SETMAN_IPTABLES_RESTORE }, oss.str());
+  }
+
+  vector< pair<string, string> > policies;
+  vector< pair<string, argv_t> > rules;
+  string chain;     /* empty: the ruleset owns the whole table */
+  string iface;
+};
 
+string subsys_names(unsigned subsys) {
+  static const char *names[] = { "net", "user", "serial", "syslog", "time" };
+  string r;
+  for(int i = 0; i < 5; i++) {
+    if(subsys & (1u << i))
+      r += (r.empty() ? "" : ",") + string(names[i]);
+  }
+  return r.empty() ? "none" : r;
 }
 
-/* 'confirm' command, marking configuration as 'good' */
-void with_confirm(cmdmode_t mode, const args &a, bool &confirmed, function< void ( fchecker_t ) > f) {
+/*
+ * Typed command IR. A command file is compiled (parsed and validated) once,
+ * handlers then execute the IR. Compilation has no side effects, it
+ * replaces the former 'dryrun' pass.
+ */
 
-  confirmed = false;
+struct ip_t {
+  string ip, mask, gw, dns1, dns2, dns3;
 
-  f([&](string cmd, istream &s) {
-    if (cmd == "confirm") {
-      string e;
-      throw_if( s >> e );
-      confirmed = true;
-      return true;
-    }
-    else {
-      return false;
-    }
-  });
+  bool operator==(const ip_t &o) const {
+    return ip == o.ip && mask == o.mask && gw == o.gw &&
+           dns1 == o.dns1 && dns2 == o.dns2 && dns3 == o.dns3;
+  }
+};
 
-}
+struct allow_t {
+  string ip, mask;
+
+  bool operator==(const allow_t &o) const { return ip == o.ip && mask == o.mask; }
+};
 
-typedef function<void(istream&, const args&, cmdmode_t)> fapplier_t;
+struct user_t {
+  string name, pwd;
 
-void apply_state_all(istream &fs, const args &a, cmdmode_t mode) {
+  bool operator==(const user_t &o) const { return name == o.name && pwd == o.pwd; }
+};
 
-  bool confirmed = false;
+/* Serial port: 'serial DEV BAUD [FORMAT [FLOW]]', FORMAT like 8N1 (data
+ * bits, parity N/E/O, stop bits), FLOW one of none, rtscts, xonxoff */
+struct serial_t {
+  serial_t() : baud(0), data(8), parity('N'), stop(1), flow("none") {}
 
-  with_ip(mode, a, [&](fchecker_t ip_chk) {
+  string dev;
+  int baud;
+  int data;
+  char parity;
+  int stop;
+  string flow;
 
-  with_user(mode, a, [&](fchecker_t user_chk) {
+  string format() const { return ss(data << parity << stop); }
 
-  with_serial(mode, a, [&](fchecker_t serial_chk) {
+  bool operator==(const serial_t &o) const {
+    return dev == o.dev && baud == o.baud && data == o.data &&
+           parity == o.parity && stop == o.stop && flow == o.flow;
+  }
+};
 
-  with_syslog(mode, a, [&](fchecker_t syslog_chk) {
+struct syslog_t {
+  syslog_t() : port(514) {}
 
-  with_time(mode, a, [&](fchecker_t time_chk) {
+  string host;
+  int port;
 
-  with_confirm(mode, a, confirmed, [&](fchecker_t confirm_chk) {
+  bool operator==(const syslog_t &o) const { return host == o.host && port == o.port; }
+};
 
-    string line;
-    while(getline(fs, line)) {
+struct config_t {
+  config_t(unsigned subsys_ = sub_all) :
+    subsys(subsys_), dhcp(false), has_ip(false), has_time(false),
+    sec(0), usec(0), confirmed(false) {}
 
-      dbg("Command" << (mode == dryrun ? " (dryrun): " : ": ") << line );
+  unsigned subsys;  /* subsystems covered by the file (its mode) */
 
-      string cmd;
-      istringstream s(line);
+  /* net */
+  bool dhcp;
+  bool has_ip;
+  ip_t ip;
+  vector<allow_t> allow;
 
-      throw_if_not( s >> cmd );
+  /* user */
+  vector<user_t> users;
 
-      if(ip_chk(cmd, s))
-        continue;
-      else if(user_chk(cmd, s))
-        continue;
-      else if(serial_chk(cmd, s))
-        continue;
-      else if(syslog_chk(cmd, s))
-        continue;
-      else if(time_chk(cmd, s))
-        continue;
-      else if(confirm_chk(cmd, s))
-        continue;
-      else  {
-        throw_("Invalid command '" << cmd << "'");
+  /* serial */
+  vector<serial_t> serial;
+
+  /* syslog */
+  vector<syslog_t> syslog;
+
+  /* time */
+  bool has_time;
+  time_t sec;
+  suseconds_t usec;
+
+  bool confirmed;
+};
+
+/* Read-only mapping of a whole file, empty if it can't be mapped */
+struct mapped_t {
+  mapped_t(const string &fname) : data(NULL), size(0) {
+    int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+      return;
+    struct stat st;
+    if(0 == fstat(fd, &st) && st.st_size > 0) {
+      void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p != MAP_FAILED) {
+        data = (const char *)p;
+        size = st.st_size;
       }
     }
+    close(fd);
+  }
 
-  });
+  ~mapped_t() {
+    if(data)
+      munmap((void *)data, size);
+  }
 
-  });
+  const char *data;
+  size_t size;
+};
 
-  });
+/*
+ * Scanner. Command files are parsed in place: tokens are strref_t slices
+ * of the (mapped) file, nothing is copied until a value ends up in the IR.
+ * Errors name the line and column of the offending token.
+ */
+struct strref_t {
+  strref_t() : p(NULL), n(0) {}
+  strref_t(const char *p_, size_t n_) : p(p_), n(n_) {}
+
+  bool operator==(const char *s) const { return strlen(s) == n && memcmp(p, s, n) == 0; }
+  bool operator!=(const char *s) const { return !(*this == s); }
+  bool empty() const { return n == 0; }
+  string str() const { return string(p, n); }
+
+  const char *p;
+  size_t n;
+};
 
-  });
+ostream &operator<<(ostream &o, const strref_t &s) {
+  return o.write(s.p, s.n);
+}
 
-  });
+static inline bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
 
-  });
+/* Tokens of one line */
+struct cursor_t {
+  cursor_t(const char *p_, const char *end_, const char *bol_, int line_) :
+    p(p_), end(end_), bol(bol_), line(line_), col(0) {}
+
+  /* Next token, false at the end of the line */
+  bool next(strref_t &t) {
+    while(p < end && is_space(*p))
+      p++;
+    if(p == end)
+      return false;
+    const char *s = p;
+    while(p < end && !is_space(*p))
+      p++;
+    col = s - bol + 1;
+    t = strref_t(s, p - s);
+    return true;
+  }
 
-  throw_if_not(confirmed);
+  /* Next token, which must be there */
+  strref_t need(const char *what) {
+    strref_t t;
+    if(!next(t)) {
+      col = p - bol + 1;
+      fail(ss("missing " << what));
+    }
+    return t;
+  }
+
+  /* No more tokens */
+  void done() {
+    strref_t t;
+    if(next(t))
+      fail(ss("unexpected '" << t << "'"));
+  }
+
+  void fail(const string &msg) const {
+    throw_("line " << line << ":" << col << ": " << msg);
+  }
+
+  const char *p;
+  const char *end;
+  const char *bol;
+  int line;
+  int col;    /* of the last token */
+};
+
+/* Strict value parsers: no signs, spaces or leading zeros, no overflow */
+bool scan_uint(strref_t t, uint64_t max, uint64_t &v) {
+  if(t.n == 0 || t.n > 20 || (t.n > 1 && t.p[0] == '0'))
+    return false;
+  v = 0;
+  for(size_t i = 0; i < t.n; i++) {
+    unsigned d = (unsigned char)t.p[i] - '0';
+    if(d > 9 || v > (max - d) / 10)
+      return false;
+    v = v * 10 + d;
+  }
+  return true;
+}
+
+bool scan_ipv4(strref_t t, uint32_t &a) {
+  a = 0;
+  const char *p = t.p, *end = t.p + t.n;
+  for(int i = 0; i < 4; i++) {
+    const char *s = p;
+    while(p < end && *p != '.')
+      p++;
+    uint64_t o;
+    if(!scan_uint(strref_t(s, p - s), 255, o))
+      return false;
+    a = (a << 8) | o;
+    if(i < 3) {
+      if(p == end)
+        return false;
+      p++;
+    }
+  }
+  return p == end;
+}
+
+bool scan_netmask(strref_t t) {
+  uint32_t m;
+  return scan_ipv4(t, m) && (m & (~m >> 1)) == 0;
+}
+
+/* An address, '-' where it may be disabled */
+string need_ipv4(cursor_t &s, const char *what, bool optional) {
+  strref_t t = s.need(what);
+  uint32_t a;
+  if(!(optional && t == "-") && !scan_ipv4(t, a))
+    s.fail(ss("invalid " << what << " '" << t << "'"));
+  return t.str();
+}
+
+uint64_t need_uint(cursor_t &s, const char *what, uint64_t max) {
+  strref_t t = s.need(what);
+  uint64_t v;
+  if(!scan_uint(t, max, v))
+    s.fail(ss("invalid " << what << " '" << t << "'"));
+  return v;
 }
 
-template<class T>
-void apply_state_1(T f, istream &fs, const args &a, cmdmode_t mode) {
+typedef void (*fparser_t)(config_t&, cursor_t&);
 
-  bool confirmed = false;
+void parse_dhcp(config_t &c, cursor_t &s) {
+  s.done();
+  c.dhcp = true;
+}
+
+void parse_ip(config_t &c, cursor_t &s) {
+  ip_t &r = c.ip;
+  if(c.has_ip)
+    s.fail("duplicate 'ip'");
+  r.ip = need_ipv4(s, "address", true);
+  r.mask = need_ipv4(s, "netmask", true);
+  if(r.mask != "-" && !scan_netmask(strref_t(r.mask.data(), r.mask.size())))
+    s.fail("netmask '" + r.mask + "' isn't contiguous");
+  r.gw = need_ipv4(s, "gateway", true);
+
+  /* The name servers are optional */
+  string *dns[] = { &r.dns1, &r.dns2, &r.dns3 };
+  strref_t t;
+  for(string *d : dns) {
+    const char *p = s.p;
+    if(!s.next(t))
+      break;
+    s.p = p;
+    *d = need_ipv4(s, "name server", true);
+  }
+  s.done();
+  c.has_ip = true;
+}
+
+void parse_off(config_t &, cursor_t &s) {
+  s.done();
+  /* no args, do nothing */
+}
 
-  f(mode, a, [&](fchecker_t chk) {
+void parse_allow(config_t &c, cursor_t &s) {
+  allow_t r;
+  r.ip = need_ipv4(s, "address", false);
+  r.mask = need_ipv4(s, "netmask", false);
+  s.done();
+  c.allow.push_back(r);
+}
 
-  with_confirm(mode, a, confirmed, [&](fchecker_t confirm_chk) {
+/* Lower case letters, digits, '_' and '-', not starting with a digit or '-' */
+static bool valid_user(strref_t t) {
+  if(t.n == 0 || t.n > 32 || t.p[0] == '-' || (t.p[0] >= '0' && t.p[0] <= '9'))
+    return false;
+  for(size_t i = 0; i < t.n; i++) {
+    char ch = t.p[i];
+    if(!((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '_' || ch == '-'))
+      return false;
+  }
+  return true;
+}
+
+void parse_user(config_t &c, cursor_t &s) {
+  user_t r;
+  strref_t name = s.need("user name");
+  if(!valid_user(name))
+    s.fail(ss("invalid user name '" << name << "'"));
+  r.name = name.str();
+  r.pwd = s.need("password").str();
+  s.done();
+  c.users.push_back(r);
+}
+
+/* termios speed of a baud rate, B0 if it isn't a standard one */
+speed_t baud_speed(int baud) {
+  static const struct { int baud; speed_t speed; } speeds[] = {
+    { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+    { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+    { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+    { 921600, B921600 }, { 1000000, B1000000 }, { 2000000, B2000000 },
+    { 4000000, B4000000 }
+  };
+  for(const auto &s : speeds) {
+    if(s.baud == baud)
+      return s.speed;
+  }
+  return B0;
+}
+
+void parse_serial(config_t &c, cursor_t &s) {
+  serial_t r;
+  strref_t dev = s.need("device");
+  r.dev = dev.str();
+  if(r.dev.compare(0, 5, "/dev/") != 0 || r.dev.find("/..") != string::npos)
+    s.fail("invalid device '" + r.dev + "'");
+  r.baud = need_uint(s, "baud rate", 4000000);
+  if(baud_speed(r.baud) == B0)
+    s.fail(ss("unsupported baud rate " << r.baud));
+
+  strref_t format, flow;
+  if(s.next(format)) {
+    r.data = format.p[0] - '0';
+    r.parity = format.n > 1 ? toupper(format.p[1]) : 0;
+    r.stop = format.n > 2 ? format.p[2] - '0' : 0;
+    if(format.n != 3 || r.data < 5 || r.data > 8 ||
+       (r.parity != 'N' && r.parity != 'E' && r.parity != 'O') ||
+       (r.stop != 1 && r.stop != 2))
+      s.fail(ss("invalid format '" << format << "'"));
+
+    if(s.next(flow)) {
+      if(flow != "none" && flow != "rtscts" && flow != "xonxoff")
+        s.fail(ss("invalid flow control '" << flow << "'"));
+      r.flow = flow.str();
+    }
+  }
+  s.done();
+
+  c.serial.push_back(r);
+}
+
+void parse_syslog(config_t &c, cursor_t &s) {
+  syslog_t r;
+  r.host = need_ipv4(s, "host", true);
+  const char *p = s.p;
+  strref_t t;
+  if(s.next(t)) {
+    s.p = p;
+    r.port = need_uint(s, "port", 65535);
+    if(r.port == 0)
+      s.fail("invalid port 0");
+  }
+  s.done();
+
+  if(c.syslog.size() >= 2)
+    s.fail("only one syslog server is supported at the moment");
+
+  c.syslog.push_back(r);
+}
+
+void parse_time(config_t &c, cursor_t &s) {
+  c.sec = need_uint(s, "seconds", LONG_MAX);
+  c.usec = need_uint(s, "microseconds", 999999);
+  s.done();
+  c.has_time = true;
+}
+
+/* 'confirm' command, marking configuration as 'good' */
+void parse_confirm(config_t &c, cursor_t &s) {
+  s.done();
+  c.confirmed = true;
+}
+
+/*
+ * Command keywords. A line is dispatched by one lookup of its keyword;
+ * the subsystem mask decides in which modes the command is accepted.
+ */
+struct command_t {
+  const char *name;
+  size_t len;
+  unsigned subsys;
+  fparser_t parse;
+};
+
+#define COMMAND(name, subsys, parse) { name, sizeof(name) - 1, subsys, parse }
+
+static const command_t commands[] = {
+  COMMAND("allow",   sub_net,    parse_allow),
+  COMMAND("confirm", sub_all,    parse_confirm),
+  COMMAND("dhcp",    sub_net,    parse_dhcp),
+  COMMAND("ip",      sub_net,    parse_ip),
+  COMMAND("off",     sub_net,    parse_off),
+  COMMAND("serial",  sub_serial, parse_serial),
+  COMMAND("syslog",  sub_syslog, parse_syslog),
+  COMMAND("time",    sub_time,   parse_time),
+  COMMAND("user",    sub_user,   parse_user),
+};
+
+#undef COMMAND
+
+const command_t *find_command(strref_t cmd) {
+  for(const command_t &k : commands) {
+    if(k.len == cmd.n && k.name[0] == cmd.p[0] && 0 == memcmp(k.name, cmd.p, cmd.n))
+      return &k;
+  }
+  return NULL;
+}
+
+config_t compile_state(const char *p, size_t size, unsigned subsys) {
+
+  config_t c(subsys);
+
+  const char *end = p + size;
+  for(int line = 1; p < end; line++) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if(eol == NULL)
+      eol = end;
+
+    trace("Command: " << strref_t(p, eol - p));
+
+    cursor_t s(p, eol, p, line);
+    strref_t cmd = s.need("command");
+
+    const command_t *k = find_command(cmd);
+    if(k == NULL || !(k->subsys & subsys))
+      s.fail(ss("invalid command '" << cmd << "'"));
+    k->parse(c, s);
+
+    p = eol + 1;
+  }
+
+  throw_if_not(c.confirmed);
+  return c;
+}
+
+config_t compile_file(const string &fname, unsigned subsys) {
+  mapped_t m(fname);
+  if(m.data == NULL) {
+    /* Not mappable: missing, empty or not a regular file */
+    ifstream f(fname, ios::binary);
+    throw_if(!f);
+    string text((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    return compile_state(text.data(), text.size(), subsys);
+  }
+  return compile_state(m.data, m.size, subsys);
+}
+
+/*
+ * Network backends: link state, IPv4 address and default route of an
+ * interface. The netlink backend talks rtnetlink in-process, the command
+ * backend runs SETMAN_IFCONFIG/SETMAN_ROUTE. SETMAN_NETLINK selects one.
+ */
+struct netbackend_t {
+  virtual ~netbackend_t() {}
+  virtual void link(const string &eth, bool up) = 0;
+  virtual void address(const string &eth, const string &ip, const string &mask) = 0;
+  virtual void default_route(const string &gw) = 0;
+};
+
+struct cmd_backend_t : netbackend_t {
+  void link(const string &eth, bool up) {
+    sys({ SETMAN_IFCONFIG, eth, up ? "up" : "down" });
+  }
+
+  void address(const string &eth, const string &ip, const string &mask) {
+    sys({ SETMAN_IFCONFIG, eth, ip, "netmask", mask });
+  }
+
+  void default_route(const string &gw) {
+    sys({ SETMAN_ROUTE, "add", "default", "gateway", gw });
+  }
+};
+
+static in_addr_t inet_of(const string &ip) {
+  struct in_addr a;
+  throw_if( 1 != inet_pton(AF_INET, ip.c_str(), &a) );
+  return a.s_addr;
+}
+
+/* Prefix length of a contiguous netmask */
+static int prefix_of(const string &mask) {
+  uint32_t m = ntohl(inet_of(mask));
+  int len = __builtin_popcount(m);
+  throw_if( m != (len == 0 ? 0 : ~0u << (32 - len)) );
+  return len;
+}
+
+struct netlink_backend_t : netbackend_t {
+
+  netlink_backend_t() : seq(0) {
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    throw_if(fd < 0);
+  }
+
+  ~netlink_backend_t() { close(fd); }
+
+  void link(const string &eth, bool up) {
+    req_t r(RTM_NEWLINK, NLM_F_REQUEST | NLM_F_ACK);
+    struct ifinfomsg *ifi = r.put<struct ifinfomsg>();
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = ifindex(eth);
+    ifi->ifi_flags = up ? IFF_UP : 0;
+    ifi->ifi_change = IFF_UP;
+    talk(r);
+  }
+
+  /* Replaces all IPv4 addresses of eth, like ifconfig does */
+  void address(const string &eth, const string &ip, const string &mask) {
+    int idx = ifindex(eth);
+    int plen = prefix_of(mask);
+
+    for(const vector<char> &old : dump_addresses(idx)) {
+      req_t d(RTM_DELADDR, NLM_F_REQUEST | NLM_F_ACK);
+      d.buf.insert(d.buf.end(), old.begin(), old.end());
+      d.hdr()->nlmsg_len = d.buf.size();
+      talk(d);
+    }
+
+    in_addr_t a = inet_of(ip);
+    in_addr_t brd = a | ~htonl(plen ? ~((1u << (32 - plen)) - 1) : 0);
+    if(plen == 32)
+      brd = a;
+
+    req_t r(RTM_NEWADDR, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE);
+    struct ifaddrmsg *ifa = r.put<struct ifaddrmsg>();
+    ifa->ifa_family = AF_INET;
+    ifa->ifa_prefixlen = plen;
+    ifa->ifa_index = idx;
+    r.attr(IFA_LOCAL, &a, sizeof(a));
+    r.attr(IFA_ADDRESS, &a, sizeof(a));
+    r.attr(IFA_BROADCAST, &brd, sizeof(brd));
+    talk(r);
+  }
+
+  void default_route(const string &gw) {
+    in_addr_t g = inet_of(gw);
+    req_t r(RTM_NEWROUTE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE);
+    struct rtmsg *rt = r.put<struct rtmsg>();
+    rt->rtm_family = AF_INET;
+    rt->rtm_table = RT_TABLE_MAIN;
+    rt->rtm_protocol = RTPROT_BOOT;
+    rt->rtm_scope = RT_SCOPE_UNIVERSE;
+    rt->rtm_type = RTN_UNICAST;
+    r.attr(RTA_GATEWAY, &g, sizeof(g));
+    talk(r);
+  }
+
+private:
+  int fd;
+  uint32_t seq;
+
+  struct req_t {
+    req_t(int type, int flags) : buf(NLMSG_HDRLEN, 0) {
+      hdr()->nlmsg_type = type;
+      hdr()->nlmsg_flags = flags;
+      hdr()->nlmsg_len = buf.size();
+    }
+
+    struct nlmsghdr *hdr() { return (struct nlmsghdr *)buf.data(); }
+
+    template<class T>
+    T* put() {
+      size_t off = buf.size();
+      buf.resize(off + NLMSG_ALIGN(sizeof(T)), 0);
+      hdr()->nlmsg_len = buf.size();
+      return (T*)(buf.data() + off);
+    }
+
+    void attr(int type, const void *data, size_t len) {
+      size_t off = buf.size();
+      buf.resize(off + RTA_SPACE(len), 0);
+      struct rtattr *rta = (struct rtattr *)(buf.data() + off);
+      rta->rta_type = type;
+      rta->rta_len = RTA_LENGTH(len);
+      memcpy(RTA_DATA(rta), data, len);
+      hdr()->nlmsg_len = buf.size();
+    }
+
+    vector<char> buf;
+  };
+
+  int ifindex(const string &eth) {
+    int idx = if_nametoindex(eth.c_str());
+    if(idx == 0)
+      throw_("No such interface '" << eth << "'");
+    return idx;
+  }
+
+  /* Sends the request and processes replies until the ack (or the end of
+   * a dump). Each reply message is passed to f */
+  void talk(req_t &r, function<void(struct nlmsghdr *)> f = nullptr) {
+    r.hdr()->nlmsg_seq = ++seq;
+    throw_if( send(fd, r.buf.data(), r.buf.size(), 0) != (ssize_t)r.buf.size() );
+
+    vector<char> buf(32768);
+    for(;;) {
+      ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+      if(n < 0 && errno == EINTR)
+        continue;
+      throw_if(n < 0);
+
+      for(struct nlmsghdr *h = (struct nlmsghdr *)buf.data(); NLMSG_OK(h, (size_t)n); h = NLMSG_NEXT(h, n)) {
+        if(h->nlmsg_seq != seq)
+          continue;
+        if(h->nlmsg_type == NLMSG_DONE)
+          return;
+        if(h->nlmsg_type == NLMSG_ERROR) {
+          struct nlmsgerr *e = (struct nlmsgerr *)NLMSG_DATA(h);
+          if(e->error == 0)
+            return;
+          errno = -e->error;
+          throw_("netlink request " << r.hdr()->nlmsg_type << " failed: " << strerror(-e->error));
+        }
+        if(f)
+          f(h);
+      }
+    }
+  }
+
+  /* IPv4 addresses of the interface, as ifaddrmsg + attributes */
+  vector< vector<char> > dump_addresses(int idx) {
+    vector< vector<char> > res;
+    req_t r(RTM_GETADDR, NLM_F_REQUEST | NLM_F_DUMP);
+    struct ifaddrmsg *ifa = r.put<struct ifaddrmsg>();
+    ifa->ifa_family = AF_INET;
+    talk(r, [&](struct nlmsghdr *h) {
+      struct ifaddrmsg *m = (struct ifaddrmsg *)NLMSG_DATA(h);
+      if(h->nlmsg_type == RTM_NEWADDR && m->ifa_index == (unsigned)idx) {
+        char *p = (char*)NLMSG_DATA(h);
+        res.push_back(vector<char>(p, p + h->nlmsg_len - NLMSG_HDRLEN));
+      }
+    });
+    return res;
+  }
+};
+
+unique_ptr<netbackend_t> make_netbackend() {
+#if SETMAN_NETLINK
+  return unique_ptr<netbackend_t>(new netlink_backend_t());
+#else
+  return unique_ptr<netbackend_t>(new cmd_backend_t());
+#endif
+}
+
+/*
+ * Allow list engine. The 'allow' networks are canonicalized (host bits
+ * cleared), deduplicated and merged into the minimal set of covering
+ * prefixes. Small sets become one rule per prefix, larger ones a single
+ * hash:net set (SETMAN_IPSET) matched by one rule, so the per-packet cost
+ * doesn't grow with the list.
+ */
+struct cidr_t {
+  uint32_t net;   /* host byte order */
+  int len;
+
+  bool operator<(const cidr_t &o) const { return net < o.net || (net == o.net && len < o.len); }
+};
+
+static uint32_t mask_of(int len) {
+  return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+static bool covers(const cidr_t &p, const cidr_t &c) {
+  return p.len <= c.len && (c.net & mask_of(p.len)) == p.net;
+}
+
+static string cidr_str(const cidr_t &c) {
+  char buf[INET_ADDRSTRLEN];
+  struct in_addr a;
+  a.s_addr = htonl(c.net);
+  throw_if( NULL == inet_ntop(AF_INET, &a, buf, sizeof(buf)) );
+  return ss(buf << "/" << c.len);
+}
+
+struct allowset_t {
+
+  /* Non-contiguous masks can't be aggregated, they are kept as is (with
+   * the address masked, as iptables-save prints it) */
+  explicit allowset_t(const vector<allow_t> &allow) {
+    vector<cidr_t> in;
+    for(const allow_t &r : allow) {
+      uint32_t m = ntohl(inet_of(r.mask));
+      int len = __builtin_popcount(m);
+      if(m != mask_of(len)) {
+        string net = cidr_str({ ntohl(inet_of(r.ip)) & m, 32 });
+        raw.push_back(net.substr(0, net.find('/')) + "/" + r.mask);
+        continue;
+      }
+      in.push_back({ ntohl(inet_of(r.ip)) & m, len });
+    }
+
+    sort(in.begin(), in.end());
+    sort(raw.begin(), raw.end());
+    raw.erase(unique(raw.begin(), raw.end()), raw.end());
+
+    /* Sorted by address, a prefix precedes everything it covers. Adjacent
+     * halves of the same parent are merged, repeatedly */
+    for(const cidr_t &c : in) {
+      if(!nets.empty() && covers(nets.back(), c))
+        continue;
+      nets.push_back(c);
+      while(nets.size() >= 2) {
+        cidr_t &l = nets[nets.size() - 2];
+        const cidr_t &h = nets.back();
+        if(l.len != h.len || l.len == 0 || l.net != (h.net & mask_of(l.len - 1)) ||
+           h.net != (l.net | (1u << (32 - l.len))))
+          break;
+        l.len--;
+        nets.pop_back();
+      }
+    }
+
+    dbg("Allow list: " << allow.size() << " entries, " << nets.size() << " prefixes, " << raw.size() << " raw");
+  }
+
+  bool any() const { return !nets.empty() && nets[0].len == 0; }
+
+  /* ipset restore script which fills the set and swaps it in atomically */
+  string ipset_script(const string &name) const {
+    const string tmp = name + "-new";
+    ostringstream oss;
+    oss << "create " << name << " hash:net family inet -exist\n";
+    oss << "create " << tmp << " hash:net family inet maxelem " << max<size_t>(nets.size(), 65536) << " -exist\n";
+    oss << "flush " << tmp << "\n";
+    for(const cidr_t &c : nets)
+      oss << "add " << tmp << " " << cidr_str(c) << "\n";
+    oss << "swap " << tmp << " " << name << "\n";
+    oss << "destroy " << tmp << "\n";
+    return oss.str();
+  }
+
+  /* Whether the set dumped in live (ipset save) holds exactly the prefixes */
+  bool set_in_effect(const string &name, const string &live) const {
+    vector<string> have, want;
+    istringstream in(live);
+    string l;
+    while(getline(in, l)) {
+      istringstream ls(l);
+      string cmd, set, member;
+      if(ls >> cmd >> set >> member && cmd == "add" && set == name)
+        have.push_back(member.find('/') == string::npos ? member + "/32" : member);
+    }
+    for(const cidr_t &c : nets)
+      want.push_back(cidr_str(c));
+    sort(have.begin(), have.end());
+    sort(want.begin(), want.end());
+    return have == want;
+  }
+
+  /* Appends the accepting rules, loading the set first when it's used and
+   * differs from the live one */
+  void emit(ruleset_t &rs, const string &set, const string *live = NULL) const {
+    if(any()) {
+      rs.append("INPUT", { "-j", "ACCEPT" });
+      return;
+    }
+
+    if(nets.size() >= SETMAN_IPSET_MIN) {
+      if(live && set_in_effect(set, *live))
+        dbg("Allow set " << set << " is in effect");
+      else
+        sys({ SETMAN_IPSET_RESTORE }, ipset_script(set));
+      rs.append("INPUT", { "-m", "set", "--match-set", set, "src", "-j", "ACCEPT" });
+    }
+    else {
+      for(const cidr_t &c : nets)
+        rs.append("INPUT", { "-s", cidr_str(c), "-j", "ACCEPT" });
+    }
+
+    for(const string &r : raw)
+      rs.append("INPUT", { "-s", r, "-j", "ACCEPT" });
+  }
+
+  vector<cidr_t> nets;
+  vector<string> raw;
+};
+
+/* Names of the per-interface network objects */
+static string dhcp_pidfile(const args &a) { return SETMAN_DHCPPID + a.scope; }
+static string ipset_name(const args &a) { return SETMAN_IPSET + a.scope; }
+static string fw_chain(const args &a) { return "setman-" + a.eth; }
+
+/* Effective settings, see snapshot_take(). Handlers converging on a
+ * config compare against one taken at the start of the run */
+struct snapshot_t {
+  snapshot_t() :
+    subsys(0), probed(0), has_set(false), has_link(false), up(false), has_addr(false),
+    has_gw(false), has_resolv(false), syslogd(false) {}
+
+  unsigned subsys;  /* subsystems the snapshot restores */
+  unsigned probed;  /* subsystems whose live settings were read */
+
+  /* net */
+  string dhcp;      /* interface of the running DHCP client, if any */
+  string rules;     /* iptables-save dump of the filter table */
+  bool has_set;
+  string set;       /* ipset save dump of SETMAN_IPSET */
+  bool has_link;
+  bool up;
+  bool has_addr;
+  string ip, mask;
+  bool has_gw;
+  string gw;
+  bool has_resolv;
+  string resolv;
+
+  /* syslog */
+  bool syslogd;     /* running */
+  vector<string> syslog;
+};
+
+/* The live settings to converge subsystem sub from, NULL to apply all */
+static const snapshot_t *live_of(const args &a, unsigned sub) {
+  return (a.converge && a.live && (a.live->probed & sub)) ? a.live : NULL;
+}
+
+void with_ip(const args &a, const config_t &c) {
+
+  const snapshot_t *live = live_of(a, sub_net);
+
+  /* Converging, a client already serving the interface is left alone */
+  bool keep = live && c.dhcp && live->dhcp == a.eth;
+  if(keep)
+    dbg("DHCP client on " << a.eth << " is in effect");
+
+  /* Stop dhcpc (if any), letting it release the lease first */
+  fstream dhcppid(dhcp_pidfile(a), ios_base::in);
+  int pid = 0;
+  if(keep) {
+    /* nothing to stop */
+  }
+  else if(dhcppid >> pid && pid > 0) {
+    if(!stop_process(pid, { SETMAN_DHCP_STOP }))
+      err("dhcp client " << pid << " survived all signals");
+  }
+  else {
+    dbg("Error accessing " << dhcp_pidfile(a) << " (file doesn't exist?)");
+  }
+
+  unique_ptr<netbackend_t> net = make_netbackend();
+
+  /* Reset the interface. Converging, it's only taken down to stay down */
+  if(!keep && (!live || (!c.has_ip && live->up)))
+    net->link(a.eth, false);
+
+  /* Default firewall. Committed together with the 'allow' rules below */
+  ruleset_t rs;
+  rs.policy("INPUT", "DROP");
+  rs.policy("FORWARD", "DROP");
+  rs.policy("OUTPUT", "ACCEPT");
+  if(!a.scope.empty())
+    rs.scope(fw_chain(a), a.eth);
+
+  /* Spelled the way iptables-save prints them, see in_effect() */
+  rs.append("INPUT", { "-i", "lo", "-j", "ACCEPT" });
+  rs.append("INPUT", { "-p", "icmp", "-j", "ACCEPT" });
+  rs.append("INPUT", { "-p", "tcp", "-m", "state", "--state", "RELATED,ESTABLISHED", "-j", "ACCEPT" });
+  rs.append("INPUT", { "-p", "udp", "-m", "udp", "--sport", "53", "--dport", "1024:65535", "-m", "state", "--state", "ESTABLISHED", "-j", "ACCEPT" });
+  rs.append("INPUT", { "-p", "udp", "-m", "udp", "--sport", "123", "-j", "ACCEPT" });
+
+  if(c.has_ip) {
+    const ip_t &r = c.ip;
+
+    if(!live || !live->up)
+      net->link(a.eth, true);
+
+    if(!live || !(live->has_addr && live->ip == r.ip && live->mask == r.mask))
+      net->address(a.eth, r.ip, r.mask);
+
+    if(r.gw != "-" && r.gw != "0.0.0.0" && !(live && live->has_gw && live->gw == r.gw)) {
+      net->default_route(r.gw);
+    }
+
+    string resolv;
+    for(const string *d : { &r.dns1, &r.dns2, &r.dns3 }) {
+      if(ip_enabled(*d))
+        resolv += "nameserver " + *d + "\n";
+    }
+
+    if(live && live->has_resolv && live->resolv == resolv) {
+      dbg(SETMAN_RESOLVCONF " is in effect");
+    }
+    else {
+      bool moved = false;
+      const char *tmp = SETMAN_RESOLVCONF ".new";
+      const char *fin = SETMAN_RESOLVCONF;
+      FILE* f = fopen(tmp, "we");
+      throw_if(f == NULL);
+      atret( if(f) fclose(f) );
+      atret( if(!moved) remove(tmp) );
+
+      throw_if( resolv.size() != fwrite(resolv.data(), 1, resolv.size(), f) );
+
+      throw_if( 0 != fclose(f) );
+      f = NULL;
+
+      throw_if( 0 != rename(tmp, fin) );
+      moved = true;
+    }
+  }
+
+  if(c.dhcp && !keep) {
+    sys({ SETMAN_DHCP, "-i", a.eth, "-R", "-p", dhcp_pidfile(a) });
+  }
+
+  allowset_t(c.allow).emit(rs, ipset_name(a), live && live->has_set ? &live->set : NULL);
+
+  if(live && rs.in_effect(live->rules))
+    dbg("Firewall is in effect");
+  else
+    rs.commit();
+}
+
+/*
+ * Native user backend. The whole batch is hashed in parallel (SHA-512
+ * crypt) and passwd and shadow under SETMAN_ROOT are rewritten once each,
+ * by an atomic rename, while holding the password file lock. Unknown users
+ * are created.
+ */
+
+/* SHA-512 crypt hashes of the passwords, computed on all cores */
+static vector<string> hash_passwords(const vector<user_t> &users) {
+  static const char chars[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+  vector<unsigned char> rnd(users.size() * 16);
+  for(size_t off = 0; off < rnd.size(); ) {
+    ssize_t n = getrandom(rnd.data() + off, rnd.size() - off, 0);
+    if(n < 0 && errno == EINTR)
+      continue;
+    throw_if(n < 0);
+    off += n;
+  }
+
+  vector<string> salts(users.size(), "$6$"), hashes(users.size());
+  for(size_t i = 0; i < rnd.size(); i++)
+    salts[i / 16] += chars[rnd[i] & 63];
+
+  size_t nthreads = max(1u, thread::hardware_concurrency());
+  nthreads = min(nthreads, users.size());
+  bool failed = false;
+  mutex mtx;
+
+  auto worker = [&](size_t first) {
+    unique_ptr<struct crypt_data> d(new struct crypt_data);
+    memset(d.get(), 0, sizeof(struct crypt_data));
+    for(size_t i = first; i < users.size(); i += nthreads) {
+      const char *h = crypt_r(users[i].pwd.c_str(), (salts[i] + "$").c_str(), d.get());
+      if(h == NULL || h[0] == '*') {
+        lock_guard<mutex> l(mtx);
+        failed = true;
+        return;
+      }
+      hashes[i] = h;
+    }
+  };
+
+  vector<thread> pool;
+  for(size_t t = 1; t < nthreads; t++)
+    pool.push_back(thread(worker, t));
+  if(nthreads > 0)
+    worker(0);
+  for(thread &t : pool)
+    t.join();
+
+  throw_if(failed);
+  return hashes;
+}
+
+/* lckpwdf() guards the real /etc only, a scratch root gets a lock of its own */
+static void lock_pwfiles(guard &g, const string &root) {
+  if(root.empty()) {
+    throw_if( 0 != lckpwdf() );
+    g.next( []() { ulckpwdf(); } );
+    return;
+  }
+  throw_if( 0 != mkdir((root + "/etc").c_str(), 0755) && errno != EEXIST );
+  int fd = open_lockfile(root + "/etc/.pwd.lock");
+  g.next( [=]() { close(fd); } );
+  throw_if( 0 != flock(fd, LOCK_EX) );
+}
+
+/* Rewrites path through a temporary file: write(in, out) streams the
+ * entries, in is NULL if path doesn't exist yet */
+static void rewrite_file(const string &path, mode_t mode, function<void(FILE *, FILE *)> write) {
+  FILE *in = fopen(path.c_str(), "re");
+  throw_if(in == NULL && errno != ENOENT);
+  atret( if(in) fclose(in) );
+
+  struct stat st;
+  if(in && 0 == fstat(fileno(in), &st))
+    mode = st.st_mode & 07777;
+
+  string tmp = path + ".setman";
+  FILE *out = fopen(tmp.c_str(), "we");
+  throw_if(out == NULL);
+  bool done = false;
+  atret( if(out) fclose(out); if(!done) remove(tmp.c_str()); );
+
+  throw_if( 0 != fchmod(fileno(out), mode) );
+  if(in)
+    throw_if( 0 != fchown(fileno(out), st.st_uid, st.st_gid) );
+
+  write(in, out);
+
+  throw_if( 0 != fflush(out) || 0 != fsync(fileno(out)) );
+  int ret = fclose(out);
+  out = NULL;
+  throw_if(ret != 0);
+  throw_if( 0 != rename(tmp.c_str(), path.c_str()) );
+  done = true;
+}
+
+/* Copies the lines of a passwd-like file from in to out. fix gets the
+ * fields of each entry and returns true if it changed them; all other
+ * lines, comments and NIS '+'/'-' entries included, are copied as is */
+static void copy_pwlines(FILE *in, FILE *out, function<bool(vector<string> &)> fix) {
+  char *buf = NULL;
+  size_t n = 0;
+  ssize_t len;
+  atret( free(buf) );
+  bool nl = true;
+  while(in && (len = getline(&buf, &n, in)) > 0) {
+    string line(buf, len);
+    nl = line.back() == '\n';
+    vector<string> f;
+    if(line[0] != '#' && line[0] != '+' && line[0] != '-') {
+      string entry = nl ? line.substr(0, line.size() - 1) : line;
+      size_t at = 0, colon;
+      while((colon = entry.find(':', at)) != string::npos) {
+        f.push_back(entry.substr(at, colon - at));
+        at = colon + 1;
+      }
+      f.push_back(entry.substr(at));
+    }
+    if(f.size() > 1 && !f[0].empty() && fix(f)) {
+      line.clear();
+      for(size_t i = 0; i < f.size(); i++)
+        line += (i ? ":" : "") + f[i];
+      line += nl ? "\n" : "";
+    }
+    throw_if( fwrite(line.data(), 1, line.size(), out) != line.size() );
+  }
+  throw_if( in && !feof(in) );
+  /* New entries are appended after the last line */
+  if(!nl)
+    throw_if( EOF == fputc('\n', out) );
+}
+
+void users_native(const vector<user_t> &users) {
+  const string root = SETMAN_ROOT;
+  vector<string> hashes = hash_passwords(users);
+
+  guard g;
+  lock_pwfiles(g, root);
+
+  map<string, size_t> todo;   /* user -> index, until it's written */
+  for(size_t i = 0; i < users.size(); i++)
+    todo[users[i].name] = i;
+
+  /* Primary group of new users */
+  gid_t gid = 100;
+  FILE *gf = fopen((root + "/etc/group").c_str(), "re");
+  if(gf) {
+    struct group *gr;
+    while((gr = fgetgrent(gf)) != NULL) {
+      if(string(gr->gr_name) == "users")
+        gid = gr->gr_gid;
+    }
+    fclose(gf);
+  }
+
+  /* Shadow first: an entry without a passwd line is harmless */
+  long today = time(NULL) / 86400;
+  map<string, size_t> left = todo;
+  rewrite_file(root + "/etc/shadow", 0600, [&](FILE *in, FILE *out) {
+    copy_pwlines(in, out, [&](vector<string> &f) -> bool {
+      auto i = left.find(f[0]);
+      if(i == left.end() || f.size() < 3)
+        return false;
+      f[1] = hashes[i->second];
+      f[2] = to_string(today);
+      left.erase(i);
+      return true;
+    });
+
+    for(const auto &i : left) {
+      struct spwd n;
+      memset(&n, 0, sizeof(n));
+      n.sp_namp = (char *)i.first.c_str();
+      n.sp_pwdp = (char *)hashes[i.second].c_str();
+      n.sp_lstchg = today;
+      n.sp_min = 0;
+      n.sp_max = 99999;
+      n.sp_warn = 7;
+      n.sp_inact = -1;
+      n.sp_expire = -1;
+      n.sp_flag = ~0ul;
+      throw_if( 0 != putspent(&n, out) );
+    }
+  });
+
+  left = todo;
+  rewrite_file(root + "/etc/passwd", 0644, [&](FILE *in, FILE *out) {
+    uid_t next = 1000;
+    copy_pwlines(in, out, [&](vector<string> &f) -> bool {
+      if(f.size() < 3)
+        return false;
+      unsigned long uid = strtoul(f[2].c_str(), NULL, 10);
+      if(uid >= next && uid < 60000)
+        next = uid + 1;
+      auto i = left.find(f[0]);
+      if(i == left.end())
+        return false;
+      f[1] = "x";
+      left.erase(i);
+      return true;
+    });
+
+    for(const auto &i : left) {
+      string home = "/home/" + i.first;
+      struct passwd n;
+      n.pw_name = (char *)i.first.c_str();
+      n.pw_passwd = (char *)"x";
+      n.pw_uid = next++;
+      n.pw_gid = gid;
+      n.pw_gecos = (char *)"";
+      n.pw_dir = (char *)home.c_str();
+      n.pw_shell = (char *)"/bin/sh";
+      throw_if( 0 != putpwent(&n, out) );
+      dbg("Created user " << i.first << " uid " << n.pw_uid);
+    }
+  });
+
+  dbg("Set passwords of " << users.size() << " users");
+}
+
+void with_user(const args &a, const config_t &c) {
+
+#if SETMAN_USERS_NATIVE
+  if(!c.users.empty())
+    users_native(c.users);
+#else
+  /* 'user pwd' lines for SETMAN_UPWD, fed to its stdin in one go */
+  string input;
+  for(const user_t &u : c.users)
+    input += u.name + " " + u.pwd + "\n";
+
+  sys({ SETMAN_UPWD }, input);
+#endif
+}
+
+/* Raw mode with the line settings of r, a couple of syscalls */
+void serial_termios(const serial_t &r) {
+  int fd = open(r.dev.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  throw_if(fd < 0);
+  atret( close(fd) );
+
+  struct termios t;
+  throw_if( 0 != tcgetattr(fd, &t) );
+  cfmakeraw(&t);
+
+  speed_t speed = baud_speed(r.baud);
+  throw_if( 0 != cfsetispeed(&t, speed) || 0 != cfsetospeed(&t, speed) );
+
+  static const tcflag_t sizes[] = { CS5, CS6, CS7, CS8 };
+  t.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+  t.c_cflag |= sizes[r.data - 5] | CLOCAL | CREAD;
+  if(r.parity != 'N')
+    t.c_cflag |= PARENB | (r.parity == 'O' ? PARODD : 0);
+  if(r.stop == 2)
+    t.c_cflag |= CSTOPB;
+
+  t.c_iflag &= ~(IXON | IXOFF | IXANY);
+  if(r.flow == "rtscts")
+    t.c_cflag |= CRTSCTS;
+  else if(r.flow == "xonxoff")
+    t.c_iflag |= IXON | IXOFF;
+
+  throw_if( 0 != tcsetattr(fd, TCSANOW, &t) );
+  dbg("Serial " << r.dev << " " << r.baud << " " << r.format() << " " << r.flow);
+}
+
+void with_serial(const args &a, const config_t &c) {
+
+#if SETMAN_SERIAL_NATIVE
+  for(const serial_t &r : c.serial)
+    serial_termios(r);
+#else
+  /* Ports are independent, they are set up concurrently */
+  vector<cmd_t> cmds;
+  for(const serial_t &r : c.serial)
+    cmds.push_back(cmd_t({ SETMAN_SERIAL, r.dev, ss(r.baud), r.format(), r.flow }));
+  if(!cmds.empty())
+    sys_all(cmds);
+#endif
+}
+
+void with_syslog(const args &a, const config_t &c) {
+
+  vector<string> targets;
+  for(const syslog_t &r : c.syslog) {
+    if(ip_enabled(r.host))
+      targets.push_back(ss(r.host << ":" << r.port));
+  }
+
+  const snapshot_t *live = live_of(a, sub_syslog);
+  if(live && live->syslogd && live->syslog == targets) {
+    dbg("syslog is in effect");
+    return;
+  }
+
+  sys({ SETMAN_SYSLOG });
+
+  for(const string &t : targets)
+    sys({ SETMAN_SYSLOG, "-R", t });
+}
+
+void with_time(const args &a, const config_t &c) {
+
+  if(c.has_time) {
+    struct timeval tv;
+    memset(&tv, 0, sizeof(struct timeval));
+    tv.tv_sec = c.sec;
+    tv.tv_usec = c.usec;
+
+    throw_if(0 != settimeofday(&tv, NULL));
+    sys({ SETMAN_HWCLOCK, "-w" });
+  }
+}
+
+/*
+ * Scheduler. Tasks run on a small pool of threads, a task starts once the
+ * subsystems in its deps are done. After a failure no new tasks start and
+ * the first exception is rethrown when the running ones have finished, so
+ * callers see the same all-or-nothing outcome as with a sequential apply.
+ */
+struct task_t {
+  unsigned sub;
+  unsigned deps;
+  function<void()> run;
+};
+
+void run_tasks(const vector<task_t> &tasks, size_t nthreads) {
+
+  unsigned present = 0;
+  for(const task_t &t : tasks)
+    present |= t.sub;
+
+  mutex mtx;
+  condition_variable cv;
+  vector<bool> started(tasks.size(), false);
+  unsigned done = 0;
+  exception_ptr error;
+
+  auto worker = [&]() {
+    unique_lock<mutex> l(mtx);
+    for(;;) {
+      size_t next = tasks.size();
+      bool left = false;
+      for(size_t i = 0; i < tasks.size(); i++) {
+        if(started[i])
+          continue;
+        left = true;
+        if((tasks[i].deps & present & ~done) == 0) {
+          next = i;
+          break;
+        }
+      }
+
+      if(!left || error)
+        break;
+
+      if(next == tasks.size()) {
+        cv.wait(l);
+        continue;
+      }
+
+      started[next] = true;
+      l.unlock();
+      exception_ptr e;
+      struct timespec t0;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      try {
+        tasks[next].run();
+      }
+      catch(...) {
+        e = current_exception();
+      }
+      g_metrics.add("handler:" + subsys_names(tasks[next].sub), ms_since(t0), (bool)e);
+      l.lock();
+      if(e && !error)
+        error = e;
+      done |= tasks[next].sub;
+      cv.notify_all();
+    }
+    cv.notify_all();
+  };
+
+  vector<thread> pool;
+  for(size_t i = 1; i < min(nthreads, tasks.size()); i++)
+    pool.push_back(thread(worker));
+  worker();
+  for(thread &t : pool)
+    t.join();
+
+  if(error)
+    rethrow_exception(error);
+}
+
+/* Run the handlers of subsystems both covered by c and selected in a.
+ * Remote syslog needs the network, the others are independent. step, if
+ * given, is called before and after each handler */
+typedef function<void(unsigned sub, bool done)> step_t;
+
+void apply_config(const config_t &c, const args &a, step_t step = step_t()) {
+
+  unsigned subsys = c.subsys & a.subsys;
+
+  dbg("Applying " << subsys_names(subsys));
+
+  vector<task_t> tasks;
+  if(subsys & sub_net)
+    tasks.push_back({ sub_net, 0, [&]() { with_ip(a, c); } });
+  if(subsys & sub_user)
+    tasks.push_back({ sub_user, 0, [&]() { with_user(a, c); } });
+  if(subsys & sub_serial)
+    tasks.push_back({ sub_serial, 0, [&]() { with_serial(a, c); } });
+  if(subsys & sub_syslog)
+    tasks.push_back({ sub_syslog, sub_net, [&]() { with_syslog(a, c); } });
+  if(subsys & sub_time)
+    tasks.push_back({ sub_time, 0, [&]() { with_time(a, c); } });
+
+  if(step) {
+    for(task_t &t : tasks) {
+      function<void()> run = t.run;
+      unsigned sub = t.sub;
+      t.run = [=]() { step(sub, false); run(); step(sub, true); };
+    }
+  }
+
+  run_tasks(tasks, DEFAULT_THREADS);
+}
+
+/*
+ * Diff engine. Only subsystems whose effective settings differ between the
+ * committed state and the new file have to be re-applied.
+ */
+unsigned diff_config(const config_t &o, const config_t &n) {
+  unsigned changed = 0;
+  if(!(o.dhcp == n.dhcp && o.has_ip == n.has_ip && o.ip == n.ip && o.allow == n.allow))
+    changed |= sub_net;
+  if(!(o.users == n.users))
+    changed |= sub_user;
+  if(!(o.serial == n.serial))
+    changed |= sub_serial;
+  if(!(o.syslog == n.syslog))
+    changed |= sub_syslog;
+  if(!(o.has_time == n.has_time && o.sec == n.sec && o.usec == n.usec))
+    changed |= sub_time;
+  return changed & o.subsys & n.subsys;
+}
+
+
+/* Identifies the current boot, state applied during another boot is stale */
+string boot_id() {
+  ifstream f("/proc/sys/kernel/random/boot_id");
+  string id;
+  f >> id;
+  return id;
+}
+
+/* Remember that the state stnm is in effect on eth during this boot */
+void mark_boot(const string &stnm, const string &eth) {
+  ofstream f(stnm + ".boot");
+  f << boot_id() << " " << eth << endl;
+  if(!f)
+    err("Failed to write " << stnm << ".boot");
+}
+
+static void hold_lockfile(guard &g, int lockfd) {
+  g.next( [=]() { close(lockfd); } );
+  g.next( [=]() { dbg("Unlocking"); flock(lockfd, LOCK_UN); } );
+}
+
+bool try_lockfile(guard &g, const string &lf) {
+  int lockfd = open_lockfile(lf);
+  if( 0 != flock(lockfd, LOCK_EX | LOCK_NB )) {
+    close(lockfd);
+    return false;
+  }
+  else {
+    hold_lockfile(g, lockfd);
+    return true;
+  }
+}
+
+/* OFD lock on [at, at+len) of fd; false if it would block or the wait
+ * was interrupted */
+static bool range_lock(int fd, off_t at, off_t len, bool wait) {
+  struct flock l;
+  memset(&l, 0, sizeof(l));
+  l.l_type = F_WRLCK;
+  l.l_whence = SEEK_SET;
+  l.l_start = at;
+  l.l_len = len;
+  if(0 == fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &l))
+    return true;
+  throw_if(errno != EAGAIN && errno != EACCES && errno != EINTR);
+  return false;
+}
+
+static void range_unlock(int fd, off_t at, off_t len) {
+  struct flock l;
+  memset(&l, 0, sizeof(l));
+  l.l_type = F_UNLCK;
+  l.l_whence = SEEK_SET;
+  l.l_start = at;
+  l.l_len = len;
+  fcntl(fd, F_OFD_SETLK, &l);
+}
+
+/* Interval of the SIGALRM re-sent after the deadline, in case one lands
+ * before the blocking call it is meant to interrupt */
+#define LOCK_TICK_MS 5
+
+/*
+ * Blocks until the lock is free, for at most wait_ms. Waiters queue up in
+ * '<lf>.q': each draws a ticket from the counter at its start and holds a
+ * lock on the byte of its ticket until it has released the lock file. A
+ * waiter goes for the lock file only once the byte of its predecessor is
+ * free, so waiters are served in FIFO order and woken by the kernel as soon
+ * as their turn comes. The kernel drops the locks of a dead process, which
+ * lets the queue move on past it.
+ */
+void lockfile(guard &g, const string &lf, long wait_ms) {
+  string qf = lf + ".q";
+  int qfd = open ( qf.c_str(), O_RDWR | O_NOCTTY | O_NOFOLLOW | O_CREAT | O_CLOEXEC, 0666 );
+  throw_if(qfd < 0);
+  int lockfd = -1;
+  bool locked = false;
+  atret( if(!locked) { if(lockfd >= 0) close(lockfd); close(qfd); } );
+
+  /* Draw a ticket and take its byte before anyone can draw the next one */
+  uint64_t ticket = 0;
+  throw_if_not( range_lock(qfd, 0, sizeof(ticket), true) );
+  {
+    atret( range_unlock(qfd, 0, sizeof(ticket)) );
+    if(pread(qfd, &ticket, sizeof(ticket), 0) != sizeof(ticket))
+      ticket = 0;
+    uint64_t next = ticket + 1;
+    throw_if( pwrite(qfd, &next, sizeof(next), 0) != sizeof(next) );
+    throw_if_not( range_lock(qfd, sizeof(ticket) + ticket, 1, false) );
+  }
+  lockfd = open_lockfile(lf);
+
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  bool served = ticket == 0;
+  bool wait = false;
+  struct sigaction olds;
+  atret( if(wait) {
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_REAL, &off, NULL);
+    sigaction(SIGALRM, &olds, NULL);
+  } );
+
+  for(;;) {
+    if(!served) {
+      /* The predecessor is done once its byte is ours */
+      off_t prev = sizeof(ticket) + ticket - 1;
+      if(range_lock(qfd, prev, 1, wait)) {
+        range_unlock(qfd, prev, 1);
+        served = true;
+        continue;
+      }
+    }
+    else if(0 == flock(lockfd, LOCK_EX | (wait ? 0 : LOCK_NB)))
+      break;
+    else
+      throw_if(errno != EWOULDBLOCK && errno != EINTR);
+
+    if(!wait) {
+      if(wait_ms <= 0)
+        throw_("Failed to lock the lockfile '" << lf << "'");
+
+      err("Waiting for lockfile '" << lf << "' (up to " << wait_ms << " ms)");
+
+      struct sigaction s;
+      memset(&s, 0, sizeof(struct sigaction));
+      s.sa_handler = [](int signo) -> void { };
+      sigemptyset(&s.sa_mask);
+      s.sa_flags = 0; /* no SA_RESTART, the waits return EINTR */
+      throw_if( 0 != sigaction(SIGALRM, &s, &olds) );
+      wait = true;
+
+      struct itimerval it;
+      memset(&it, 0, sizeof(it));
+      it.it_value.tv_sec = wait_ms / 1000;
+      it.it_value.tv_usec = (wait_ms % 1000) * 1000;
+      it.it_interval.tv_usec = LOCK_TICK_MS * 1000;
+      throw_if( 0 != setitimer(ITIMER_REAL, &it, NULL) );
+    }
+    else if(ms_since(t0) >= wait_ms)
+      throw_("Failed to lock the lockfile '" << lf << "' in " << ms_since(t0) << " ms");
+  }
+
+  if(wait)
+    dbg("Locked '" << lf << "' after waiting " << ms_since(t0) << " ms");
+  locked = true;
+  g.next( [=]() { close(qfd); } );
+  hold_lockfile(g, lockfd);
+}
+
+
+/*
+ * Phase timings of a run. With --timings FILE they are appended to FILE as
+ * one flat JSON object per run, e.g. for the benchmark (bench.sh).
+ */
+struct timings_t {
+  void add(const string &phase, double ms) {
+    lock_guard<mutex> l(mtx);
+    phases.push_back(make_pair(phase, ms));
+  }
+
+  string json(const string &act, const string &mode, int exitcode) {
+    lock_guard<mutex> l(mtx);
+    ostringstream oss;
+    oss << "{\"act\":\"" << act << "\",\"mode\":\"" << mode << "\",\"exit\":" << exitcode;
+    for(const auto &p : phases)
+      oss << ",\"" << p.first << "\":" << p.second;
+    oss << "}";
+    return oss.str();
+  }
+
+  mutex mtx;
+  vector< pair<string, double> > phases;
+};
+
+static timings_t g_timings;
+
+struct phase_timer {
+  phase_timer(const char *name_) : name(name_) { clock_gettime(CLOCK_MONOTONIC, &t0); }
+  ~phase_timer() {
+    double ms = ms_since(t0);
+    g_timings.add(name, ms);
+    g_metrics.add(string("phase:") + name, ms, false);
+  }
+
+  const char *name;
+  struct timespec t0;
+};
+
+#define timed_phase(name) phase_timer CNC2(pt, __LINE__) (name)
+
+/* Run f, report exceptions as failure */
+bool txn_try(function<void()> f) {
+  try {
+    f();
+    return true;
+  }
+  catch(string &e) {
+    dbg("Exception: " << e);
+  }
+  catch(exception &e) {
+    dbg("Exception: " << e.what());
+  }
+  return false;
+}
+
+/*
+ * Snapshots of the effective settings, taken right before an apply. A
+ * rollback restores them in bulk instead of replaying the old state: the
+ * firewall (and the allow set) in one restore call each, resolv.conf in
+ * one rename, the interface address and default route, and the syslog
+ * remote targets. Settings a snapshot can't capture (a running DHCP
+ * client, users, serial ports, time) are replayed from the old state.
+ */
+
+/* '-R' targets of the running syslogd, taken from its command line */
+vector<string> syslog_targets(bool *running = NULL) {
+  vector<string> res;
+  DIR *d = opendir("/proc");
+  if(d == NULL)
+    return res;
+  atret( closedir(d) );
+
+  struct dirent *e;
+  while((e = readdir(d)) != NULL) {
+    if(e->d_name[0] < '1' || e->d_name[0] > '9')
+      continue;
+    string dir = string("/proc/") + e->d_name;
+
+    ifstream cf(dir + "/comm");
+    string comm;
+    if(!(cf >> comm) || comm != "syslogd")
+      continue;
+    if(running)
+      *running = true;
+
+    ifstream af(dir + "/cmdline");
+    vector<string> argv;
+    string arg;
+    while(getline(af, arg, '\0'))
+      argv.push_back(arg);
+    for(size_t i = 1; i < argv.size(); i++) {
+      if(argv[i] == "-R" && i + 1 < argv.size())
+        res.push_back(argv[++i]);
+      else if(argv[i].compare(0, 2, "-R") == 0 && argv[i].size() > 2)
+        res.push_back(argv[i].substr(2));
+    }
+  }
+  return res;
+}
+
+/* Interface of the running DHCP client of a, taken from its command line.
+ * "" if none runs, "?" if its interface isn't known */
+static string dhcp_iface(const args &a) {
+  ifstream f(dhcp_pidfile(a));
+  int pid = 0;
+  if(!(f >> pid && pid > 0 && kill(pid, 0) == 0))
+    return "";
+
+  ifstream cf(ss("/proc/" << pid << "/cmdline"));
+  vector<string> argv;
+  string arg;
+  while(getline(cf, arg, '\0'))
+    argv.push_back(arg);
+  for(size_t i = 0; i + 1 < argv.size(); i++) {
+    if(argv[i] == "-i")
+      return argv[i + 1];
+  }
+  return "?";
+}
+
+static string inet_str(const struct sockaddr *sa) {
+  char buf[INET_ADDRSTRLEN];
+  throw_if( NULL == inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, buf, sizeof(buf)) );
+  return buf;
+}
+
+static void snapshot_net(snapshot_t &s, const args &a) {
+  const string &eth = a.eth;
+  s.rules = sys_out({ SETMAN_IPTABLES_SAVE, "-t", "filter" });
+  if(s.rules.find("--match-set " + ipset_name(a) + " ") != string::npos) {
+    s.set = sys_out({ SETMAN_IPSET_SAVE, ipset_name(a) });
+    s.has_set = true;
+  }
+
+  struct ifaddrs *ifs;
+  throw_if( 0 != getifaddrs(&ifs) );
+  atret( freeifaddrs(ifs) );
+  for(struct ifaddrs *i = ifs; i != NULL; i = i->ifa_next) {
+    if(eth != i->ifa_name)
+      continue;
+    s.has_link = true;
+    s.up = (i->ifa_flags & IFF_UP) != 0;
+    if(!s.has_addr && i->ifa_addr && i->ifa_netmask && i->ifa_addr->sa_family == AF_INET) {
+      s.ip = inet_str(i->ifa_addr);
+      s.mask = inet_str(i->ifa_netmask);
+      s.has_addr = true;
+    }
+  }
+
+  /* Iface Destination Gateway Flags RefCnt Use Metric Mask ..., in hex */
+  ifstream rf("/proc/net/route");
+  string line;
+  getline(rf, line);
+  while(getline(rf, line)) {
+    istringstream l(line);
+    string iface;
+    unsigned long dst, gw, flags, mask;
+    int refcnt, use, metric;
+    if(!(l >> iface >> hex >> dst >> gw >> flags >> dec >> refcnt >> use >> metric >> hex >> mask))
+      continue;
+    if(dst == 0 && mask == 0 && (flags & RTF_GATEWAY)) {
+      struct sockaddr_in sa;
+      sa.sin_family = AF_INET;
+      sa.sin_addr.s_addr = gw;
+      s.gw = inet_str((struct sockaddr *)&sa);
+      s.has_gw = true;
+      break;
+    }
+  }
+
+  ifstream f(SETMAN_RESOLVCONF, ios::binary);
+  if(f) {
+    s.resolv.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+    s.has_resolv = true;
+  }
+}
+
+/* Captures what a rollback of the subsystems in subsys can restore */
+snapshot_t snapshot_take(const args &a, unsigned subsys) {
+  snapshot_t s;
+
+  /* A running DHCP client may change the settings at any time, they are
+   * only read for converging then, not restored */
+  if(subsys & sub_net) {
+    s.dhcp = dhcp_iface(a);
+    if((s.dhcp.empty() || a.converge) && txn_try([&]() { snapshot_net(s, a); })) {
+      s.probed |= sub_net;
+      if(s.dhcp.empty())
+        s.subsys |= sub_net;
+    }
+  }
+
+  /* Without a running syslogd there are no targets to restore, the old
+   * state is replayed instead */
+  if(subsys & sub_syslog) {
+    s.syslog = syslog_targets(&s.syslogd);
+    if(s.syslogd)
+      s.subsys |= sub_syslog;
+    s.probed |= sub_syslog;
+  }
+
+  dbg("Snapshot of " << subsys_names(s.subsys));
+  return s;
+}
+
+static void restore_net(const snapshot_t &s, const args &a) {
+  const string &eth = a.eth;
+
+  /* No client ran when the snapshot was taken. One started by the rejected
+   * state would overwrite the restored address and route */
+  ifstream pf(dhcp_pidfile(a));
+  int pid = 0;
+  if(pf >> pid && pid > 0 && !stop_process(pid, { SETMAN_DHCP_STOP }))
+    err("dhcp client " << pid << " survived all signals");
+  if(s.has_set) {
+    /* Recreate the set (if the new state destroyed it) and refill it */
+    istringstream in(s.set);
+    string line, creates, adds;
+    while(getline(in, line))
+      (line.compare(0, 7, "create ") == 0 ? creates : adds) += line + "\n";
+    sys({ SETMAN_IPSET_RESTORE, "-exist" }, creates + "flush " + ipset_name(a) + "\n" + adds);
+  }
+
+  if(a.scope.empty()) {
+    sys({ SETMAN_IPTABLES_RESTORE }, s.rules);
+  }
+  else {
+    /* Only the interface's chain, other interfaces may have changed since */
+    const string chain = fw_chain(a);
+    bool found = false;
+    vector<string> own;
+    istringstream in(s.rules);
+    string l;
+    while(getline(in, l)) {
+      if(l.compare(0, chain.size() + 2, ":" + chain + " ") == 0)
+        found = true;
+      else if(l.compare(0, chain.size() + 4, "-A " + chain + " ") == 0)
+        own.push_back(l);
+    }
+    ruleset_t::commit_chain(chain, eth, found ? &own : NULL, {}, {});
+  }
+
+  if(s.has_link) {
+    unique_ptr<netbackend_t> net = make_netbackend();
+    net->link(eth, false);
+    if(s.has_addr)
+      net->address(eth, s.ip, s.mask);
+    if(s.up)
+      net->link(eth, true);
+    if(s.has_gw)
+      net->default_route(s.gw);
+  }
+
+  const char *tmp = SETMAN_RESOLVCONF ".new";
+  if(s.has_resolv) {
+    {
+      ofstream f(tmp, ios::binary);
+      f << s.resolv;
+      f.close();
+      throw_if(!f);
+    }
+    throw_if( 0 != rename(tmp, SETMAN_RESOLVCONF) );
+  }
+  else {
+    remove(SETMAN_RESOLVCONF);
+  }
+}
+
+void snapshot_restore(const snapshot_t &s, const args &a) {
+  dbg("Restoring snapshot of " << subsys_names(s.subsys));
+
+  if(s.subsys & sub_net)
+    restore_net(s, a);
+
+  if(s.subsys & sub_syslog) {
+    sys({ SETMAN_SYSLOG });
+    for(const string &t : s.syslog)
+      sys({ SETMAN_SYSLOG, "-R", t });
+  }
+}
+
+/*
+ * Compiled state. Next to a committed 'setman.state[.mode]' setman keeps
+ * its compiled config_t in '<state>.bin', so later runs load it from an
+ * mmap instead of parsing the text again. The header carries a format
+ * version, the hash of the text it was compiled from and a checksum of the
+ * body; a stale or damaged file is ignored and the text is parsed.
+ */
+#define BIN_MAGIC 0x4e424d5453544553ULL   /* "SETSTMBN" */
+#define BIN_VERSION 2
+
+struct bin_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t subsys;
+  uint64_t text_hash;
+  uint64_t body_size;
+  uint64_t body_hash;
+};
+
+/* FNV-1a */
+uint64_t hash_bytes(const char *p, size_t n) {
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t hash_file(const string &fname) {
+  mapped_t m(fname);
+  return hash_bytes(m.data, m.size);
+}
+
+struct bin_writer_t {
+  void u32(uint32_t v) { buf.append((const char *)&v, sizeof(v)); }
+  void u64(uint64_t v) { buf.append((const char *)&v, sizeof(v)); }
+  void str(const string &s) { u32(s.size()); buf += s; }
+
+  string buf;
+};
+
+struct bin_reader_t {
+  bin_reader_t(const char *p_, size_t n) : p(p_), end(p_ + n) {}
+
+  uint32_t u32() { uint32_t v; get(&v, sizeof(v)); return v; }
+  uint64_t u64() { uint64_t v; get(&v, sizeof(v)); return v; }
+  string str() {
+    uint32_t n = u32();
+    throw_if( n > (size_t)(end - p) );
+    string s(p, n);
+    p += n;
+    return s;
+  }
+
+  void get(void *v, size_t n) {
+    throw_if( n > (size_t)(end - p) );
+    memcpy(v, p, n);
+    p += n;
+  }
+
+  const char *p;
+  const char *end;
+};
+
+string encode_config(const config_t &c) {
+  bin_writer_t w;
+  w.u32(c.subsys);
+  w.u32(c.dhcp);
+  w.u32(c.has_ip);
+  for(const string *s : { &c.ip.ip, &c.ip.mask, &c.ip.gw, &c.ip.dns1, &c.ip.dns2, &c.ip.dns3 })
+    w.str(*s);
+  w.u32(c.allow.size());
+  for(const allow_t &r : c.allow) {
+    w.str(r.ip);
+    w.str(r.mask);
+  }
+  w.u32(c.users.size());
+  for(const user_t &u : c.users) {
+    w.str(u.name);
+    w.str(u.pwd);
+  }
+  w.u32(c.serial.size());
+  for(const serial_t &r : c.serial) {
+    w.str(r.dev);
+    w.u32(r.baud);
+    w.u32(r.data);
+    w.u32(r.parity);
+    w.u32(r.stop);
+    w.str(r.flow);
+  }
+  w.u32(c.syslog.size());
+  for(const syslog_t &r : c.syslog) {
+    w.str(r.host);
+    w.u32(r.port);
+  }
+  w.u32(c.has_time);
+  w.u64(c.sec);
+  w.u64(c.usec);
+  w.u32(c.confirmed);
+  return w.buf;
+}
+
+config_t decode_config(bin_reader_t &r) {
+  config_t c(r.u32());
+  c.dhcp = r.u32();
+  c.has_ip = r.u32();
+  for(string *s : { &c.ip.ip, &c.ip.mask, &c.ip.gw, &c.ip.dns1, &c.ip.dns2, &c.ip.dns3 })
+    *s = r.str();
+  c.allow.resize(r.u32());
+  for(allow_t &a : c.allow) {
+    a.ip = r.str();
+    a.mask = r.str();
+  }
+  c.users.resize(r.u32());
+  for(user_t &u : c.users) {
+    u.name = r.str();
+    u.pwd = r.str();
+  }
+  c.serial.resize(r.u32());
+  for(serial_t &s : c.serial) {
+    s.dev = r.str();
+    s.baud = r.u32();
+    s.data = r.u32();
+    s.parity = r.u32();
+    s.stop = r.u32();
+    s.flow = r.str();
+  }
+  c.syslog.resize(r.u32());
+  for(syslog_t &s : c.syslog) {
+    s.host = r.str();
+    s.port = r.u32();
+  }
+  c.has_time = r.u32();
+  c.sec = r.u64();
+  c.usec = r.u64();
+  c.confirmed = r.u32();
+  throw_if( r.p != r.end );
+  return c;
+}
+
+/* Writes '<stnm>.bin' for c, compiled from the text hashing to text_hash */
+void save_compiled(const string &stnm, const config_t &c, uint64_t text_hash) {
+  string body = encode_config(c);
+  bin_header_t h;
+  memset(&h, 0, sizeof(h));
+  h.magic = BIN_MAGIC;
+  h.version = BIN_VERSION;
+  h.subsys = c.subsys;
+  h.text_hash = text_hash;
+  h.body_size = body.size();
+  h.body_hash = hash_bytes(body.data(), body.size());
+
+  string tmp = stnm + ".bin.tmp";
+  {
+    ofstream f(tmp, ios::binary);
+    f.write((const char *)&h, sizeof(h));
+    f << body;
+    f.close();
+    throw_if(!f);
+  }
+  throw_if( 0 != rename(tmp.c_str(), (stnm + ".bin").c_str()) );
+}
+
+/* Loads the compiled form of the state stnm, if it matches the text */
+bool load_compiled(const string &stnm, unsigned subsys, config_t &c) {
+  mapped_t m(stnm + ".bin");
+  bin_header_t h;
+  if(m.size < sizeof(h))
+    return false;
+  memcpy(&h, m.data, sizeof(h));
+
+  if(h.magic != BIN_MAGIC || h.version != BIN_VERSION || h.subsys != subsys ||
+     h.body_size != m.size - sizeof(h) ||
+     h.body_hash != hash_bytes(m.data + sizeof(h), h.body_size)) {
+    dbg("Compiled state of " << stnm << " is damaged or of another format");
+    return false;
+  }
+  if(h.text_hash != hash_file(stnm)) {
+    dbg("Compiled state of " << stnm << " is stale");
+    return false;
+  }
+
+  bool ok = txn_try([&]() {
+    bin_reader_t r(m.data + sizeof(h), h.body_size);
+    c = decode_config(r);
+  });
+  return ok;
+}
+
+/*
+ * Apply journal. While a transaction is in flight setman appends to
+ * '<state>.journal': a begin record with the snapshot (the undo data), a
+ * record before and after each subsystem is applied and a commit record
+ * before the state file is renamed. A journal left behind by a crash is
+ * replayed under the lock before the next change: an uncommitted
+ * transaction is undone for the subsystems it started, a committed one is
+ * finished. Records are length and checksum framed, a torn tail is ignored.
+ */
+enum { jr_begin = 'B', jr_start = 'S', jr_done = 'D', jr_commit = 'C' };
+
+string encode_snapshot(const snapshot_t &s) {
+  bin_writer_t w;
+  w.u32(s.subsys);
+  w.str(s.rules);
+  w.u32(s.has_set);
+  w.str(s.set);
+  w.u32(s.has_link);
+  w.u32(s.up);
+  w.u32(s.has_addr);
+  w.str(s.ip);
+  w.str(s.mask);
+  w.u32(s.has_gw);
+  w.str(s.gw);
+  w.u32(s.has_resolv);
+  w.str(s.resolv);
+  w.u32(s.syslogd);
+  w.u32(s.syslog.size());
+  for(const string &t : s.syslog)
+    w.str(t);
+  return w.buf;
+}
+
+snapshot_t decode_snapshot(bin_reader_t &r) {
+  snapshot_t s;
+  s.subsys = r.u32();
+  s.rules = r.str();
+  s.has_set = r.u32();
+  s.set = r.str();
+  s.has_link = r.u32();
+  s.up = r.u32();
+  s.has_addr = r.u32();
+  s.ip = r.str();
+  s.mask = r.str();
+  s.has_gw = r.u32();
+  s.gw = r.str();
+  s.has_resolv = r.u32();
+  s.resolv = r.str();
+  s.syslogd = r.u32();
+  s.syslog.resize(r.u32());
+  for(string &t : s.syslog)
+    t = r.str();
+  return s;
+}
+
+struct journal_t {
+  journal_t() : fd(-1) {}
+  ~journal_t() { close(); }
+
+  void open(const string &fname_) {
+    close();
+    fname = fname_;
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    throw_if(fd < 0);
+  }
+
+  /* Appends a record, synced unless it's only informational. Handlers
+   * run on several threads */
+  void append(char type, const string &data, bool sync = true) {
+    if(fd < 0)
+      return;
+    bin_writer_t w;
+    w.u32(data.size() + 1);
+    w.u64(0);
+    w.buf += type;
+    w.buf += data;
+    uint64_t h = hash_bytes(w.buf.data() + 12, data.size() + 1);
+    memcpy(&w.buf[4], &h, sizeof(h));
+
+    lock_guard<mutex> l(mtx);
+    throw_if( write(fd, w.buf.data(), w.buf.size()) != (ssize_t)w.buf.size() );
+    if(sync)
+      throw_if( 0 != fdatasync(fd) );
+  }
+
+  void close() {
+    if(fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+  /* The transaction is over */
+  void remove() {
+    close();
+    if(!fname.empty())
+      ::remove(fname.c_str());
+  }
+
+  /* Records of the journal fname up to the first damaged one */
+  static vector<pair<char, string>> read(const string &fname) {
+    vector<pair<char, string>> res;
+    mapped_t m(fname);
+    bin_reader_t r(m.data, m.size);
+    while(r.end - r.p >= 12) {
+      uint32_t n = r.u32();
+      uint64_t h = r.u64();
+      if(n == 0 || n > (size_t)(r.end - r.p) || h != hash_bytes(r.p, n)) {
+        dbg("Journal " << fname << " is torn after " << res.size() << " records");
+        break;
+      }
+      res.push_back(make_pair(r.p[0], string(r.p + 1, n - 1)));
+      r.p += n;
+    }
+    return res;
+  }
+
+  string fname;
+  int fd;
+  mutex mtx;
+};
+
+/*
+ * Apply transaction: the staged '.new' file, the compiled new and committed
+ * states and the subsystems to apply. Shared by the command line and the
+ * daemon.
+ */
+struct txn_t {
+  txn_t(const string &mode_, unsigned msubsys_, const args &a_) :
+    mode(mode_), msubsys(msubsys_), a(a_),
+    stnm(SETMAN_STATE + mode_ + a_.scope), tmpnm(stnm + ".new"), tmpdead(true),
+    stnm_checked(false), cnew(msubsys_), cold(msubsys_) {}
+
+  ~txn_t() {
+    if(!tmpdead) {
+      dbg("Removing " << tmpnm);
+      remove(tmpnm.c_str());
+    }
+  }
+
+  string mode;
+  unsigned msubsys;
+  args a;
+  string stnm;
+  string tmpnm;
+  bool tmpdead;
+  bool stnm_checked;
+  config_t cnew;
+  config_t cold;
+  snapshot_t snap;
+  journal_t jnl;
+};
+
+/* Copies in to out in the kernel: copy_file_range between files, splice
+ * from a pipe, plain read/write for anything else (ttys, sockets) */
+static void copy_fd(int in, int out) {
+  bool cfr = true, spl = true;
+  for(;;) {
+    ssize_t n = -1;
+    if(cfr) {
+      n = copy_file_range(in, NULL, out, NULL, 1 << 20, 0);
+      if(n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)) {
+        cfr = false;
+        continue;
+      }
+    }
+    else if(spl) {
+      n = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE);
+      if(n < 0 && errno == EINVAL) {
+        spl = false;
+        continue;
+      }
+    }
+    else {
+      char buf[65536];
+      n = read(in, buf, sizeof(buf));
+      for(ssize_t off = 0; n > 0 && off < n; ) {
+        ssize_t w = write(out, buf + off, n - off);
+        if(w < 0 && errno == EINTR)
+          continue;
+        throw_if(w < 0);
+        off += w;
+      }
+    }
+    if(n < 0 && errno == EINTR)
+      continue;
+    throw_if(n < 0);
+    if(n == 0)
+      return;
+  }
+}
+
+/* Stages the command file read from fd. A regular file of ours named
+ * srcnm, which is consumed anyway, is moved in place when it's on the same
+ * filesystem; otherwise it's copied without passing through user space.
+ * Either way the staging file is synced once */
+void txn_stage_fd(txn_t &t, int fd, const string &srcnm) {
+  timed_phase("copy");
+
+  /* srcnm itself, not a symlink to it: rename() would move the link */
+  struct stat st, lst;
+  if(!srcnm.empty() && 0 == fstat(fd, &st) && S_ISREG(st.st_mode) &&
+     st.st_nlink == 1 && st.st_uid == geteuid() &&
+     0 == lstat(srcnm.c_str(), &lst) && S_ISREG(lst.st_mode) &&
+     lst.st_dev == st.st_dev && lst.st_ino == st.st_ino &&
+     0 == rename(srcnm.c_str(), t.tmpnm.c_str())) {
+    t.tmpdead = false;
+    dbg("Moved " << srcnm << " to " << t.tmpnm);
+    throw_if( 0 != fsync(fd) );
+    return;
+  }
+
+  int out = open(t.tmpnm.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  throw_if(out < 0);
+  atret( close(out) );
+  t.tmpdead = false;
+  dbg("Copying to " << t.tmpnm);
+  copy_fd(fd, out);
+  throw_if( 0 != fsync(out) );
+}
+
+/* Copy the new command file to the '.new' staging file */
+void txn_stage(txn_t &t, istream &src) {
+  timed_phase("copy");
+  ofstream dest(t.tmpnm, ios::binary);
+  throw_if(!dest);
+  t.tmpdead = false;
+  dbg("Copying to " << t.tmpnm);
+  if(src.peek() != EOF)
+    throw_if_not( dest << src.rdbuf() );
+  dest.close();
+  throw_if(!dest);
+}
+
+/* Compile the new and the committed state and decide what to apply. The
+ * committed state is taken from 'committed' if the caller has it at hand */
+void txn_prepare(txn_t &t, const config_t *committed = NULL) {
+
+  dbg("fname " << t.tmpnm);
+  dbg("stnm " << t.stnm);
+
+  {
+    {
+      timed_phase("dryrun_new");
+      dbg("Checking syntax of " << t.tmpnm);
+      t.cnew = compile_file(t.tmpnm, t.msubsys);
+    }
+
+    timed_phase("dryrun_old");
+    if(committed) {
+      t.cold = *committed;
+      t.stnm_checked = true;
+    }
+    else if(load_compiled(t.stnm, t.msubsys, t.cold)) {
+      dbg("Loaded compiled state of " << t.stnm);
+      t.stnm_checked = true;
+    }
+    else {
+      dbg("Checking sysntax of  " << t.stnm);
+      if(0 == access(t.stnm.c_str(), F_OK)) {
+        t.cold = compile_file(t.stnm, t.msubsys);
+        t.stnm_checked = true;
+        txn_try([&]() { save_compiled(t.stnm, t.cold, hash_file(t.stnm)); });
+      }
+      else {
+        dbg("Warning: state " << t.stnm << " doesn't exist, ignoring");
+      }
+    }
+  }
+
+  if(t.stnm_checked && !t.a.full) {
+    string bootid, eth;
+    ifstream bf(t.stnm + ".boot");
+    bf >> bootid >> eth;
+
+    if(bootid != boot_id()) {
+      dbg("State " << t.stnm << " was applied during another boot");
+    }
+    else if(eth != t.a.eth) {
+      dbg("State " << t.stnm << " was applied to '" << eth << "'");
+    }
+    else {
+      t.a.subsys = diff_config(t.cold, t.cnew);
+    }
+  }
+
+  dbg("Subsystems to apply: " << subsys_names(t.a.subsys & t.msubsys));
+}
+
+bool txn_apply(txn_t &t) {
+  {
+    timed_phase("snapshot");
+    t.snap = snapshot_take(t.a, t.a.subsys & t.msubsys);
+    if(t.a.converge)
+      t.a.live = &t.snap;
+  }
+  timed_phase("apply");
+  return txn_try([&]() {
+    bin_writer_t w;
+    w.u32(t.a.subsys);
+    w.u64(hash_file(t.tmpnm));
+    w.str(t.a.eth);
+    t.jnl.open(t.stnm + ".journal");
+    t.jnl.append(jr_begin, w.buf + encode_snapshot(t.snap));
+
+    apply_config(t.cnew, t.a, [&](unsigned sub, bool done) {
+      bin_writer_t s;
+      s.u32(sub);
+      t.jnl.append(done ? jr_done : jr_start, s.buf, !done);
+    });
+  });
+}
+
+bool txn_commit(txn_t &t) {
+  timed_phase("rename");
+  return txn_try([&]() {
+    uint64_t hash = hash_file(t.tmpnm);
+    t.jnl.append(jr_commit, "");
+    throw_if( 0 != rename(t.tmpnm.c_str(), t.stnm.c_str()) );
+    mark_boot(t.stnm, t.a.eth);
+    t.tmpdead = true;
+    txn_try([&]() { save_compiled(t.stnm, t.cnew, hash); });
+    t.jnl.remove();
+  });
+}
+
+void txn_rollback(txn_t &t) {
+  timed_phase("rollback");
+  dbg("Rolling back");
+
+  /* What the snapshot doesn't cover is replayed from the old state */
+  args a = t.a;
+  a.live = NULL;
+  if(txn_try([&]() { snapshot_restore(t.snap, a); }))
+    a.subsys &= ~t.snap.subsys;
+  if(a.subsys & t.msubsys) {
+    if(!t.stnm_checked) {
+      dbg("Applying null state");
+      t.cold.confirmed = true;
+    }
+    apply_config(t.cold, a);
+  }
+  t.jnl.remove();
+}
+
+/* Replays the journal of the state of mode and a.scope, left by a run that
+ * didn't finish its transaction. The caller holds the lock. Returns false
+ * if there was nothing to recover */
+/* Removes the PID file of scope if its process is gone, as a waiter
+ * killed during the wait leaves it behind */
+static void remove_stale_pidfile(const string &scope) {
+  const string pidnm = SETMAN_PIDFILE + scope;
+  fstream pidf(pidnm, ios_base::in);
+  pid_t pid = 0;
+  if(!(pidf >> pid) || pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH)) {
+    if(0 == remove(pidnm.c_str()))
+      dbg("Removed stale " << pidnm);
+  }
+}
+
+bool txn_recover(const string &mode, unsigned msubsys, const args &a) {
+  txn_t t(mode, msubsys, a);
+  t.jnl.fname = t.stnm + ".journal";
+  if(0 != access(t.jnl.fname.c_str(), F_OK))
+    return false;
+
+  timed_phase("recover");
+  remove_stale_pidfile(a.scope);
+  vector<pair<char, string>> recs = journal_t::read(t.jnl.fname);
+  if(recs.empty() || recs[0].first != jr_begin) {
+    dbg("Journal " << t.jnl.fname << " has no transaction, removing");
+    t.jnl.remove();
+    return false;
+  }
+
+  bin_reader_t r(recs[0].second.data(), recs[0].second.size());
+  unsigned subsys = r.u32();
+  uint64_t hash = r.u64();
+  t.a.eth = r.str();
+  t.snap = decode_snapshot(r);
+
+  unsigned started = 0, done = 0;
+  bool committed = false;
+  for(const auto &rec : recs) {
+    if(rec.first == jr_start || rec.first == jr_done) {
+      bin_reader_t sr(rec.second.data(), rec.second.size());
+      (rec.first == jr_start ? started : done) |= sr.u32();
+    }
+    else if(rec.first == jr_commit) {
+      committed = true;
+    }
+  }
+
+  if(committed) {
+    /* Decided, finish the commit if the rename didn't happen */
+    if(0 == access(t.tmpnm.c_str(), F_OK) && hash_file(t.tmpnm) == hash) {
+      dbg("Recovering: finishing the commit of " << t.stnm);
+      t.cnew = compile_file(t.tmpnm, msubsys);
+      t.tmpdead = false;
+      txn_commit(t);
+    }
+    else {
+      dbg("Recovering: " << t.stnm << " was committed");
+      mark_boot(t.stnm, t.a.eth);
+      t.jnl.remove();
+    }
+    return true;
+  }
+
+  /* Undo what was started, complete or not, from the snapshot and the
+   * committed state. The staging file goes with the transaction */
+  dbg("Recovering: undoing " << subsys_names(started) << " of " <<
+      subsys_names(subsys) << " (" << subsys_names(started & ~done) << " incomplete)");
+  t.tmpdead = false;
+  t.a.subsys = started;
+  t.snap.subsys &= started;
+  if(load_compiled(t.stnm, msubsys, t.cold)) {
+    t.stnm_checked = true;
+  }
+  else if(0 == access(t.stnm.c_str(), F_OK)) {
+    t.cold = compile_file(t.stnm, msubsys);
+    t.stnm_checked = true;
+  }
+  txn_rollback(t);
+  return true;
+}
+
+/* Boot: applies the committed state of mode and a.scope as it is. Its
+ * compiled form is trusted when the checksums hold, nothing is staged or
+ * compared and all handlers start at once. The time from t0 until the
+ * network is configured is reported as 'net_ready'. The caller holds the
+ * lock. Returns the exit code */
+int txn_restore(const string &mode, unsigned msubsys, const args &a, const struct timespec &t0) {
+  txn_t t(mode, msubsys, a);
+  {
+    timed_phase("load");
+    if(load_compiled(t.stnm, msubsys, t.cold)) {
+      dbg("Loaded compiled state of " << t.stnm);
+    }
+    else if(0 == access(t.stnm.c_str(), F_OK)) {
+      t.cold = compile_file(t.stnm, msubsys);
+      txn_try([&]() { save_compiled(t.stnm, t.cold, hash_file(t.stnm)); });
+    }
+    else {
+      dbg("State " << t.stnm << " doesn't exist, nothing to restore");
+      return 0;
+    }
+  }
+
+  t.a.subsys = msubsys;
+  if(t.a.converge) {
+    timed_phase("probe");
+    t.snap = snapshot_take(t.a, msubsys);
+    t.a.live = &t.snap;
+  }
+
+  bool ok;
+  {
+    timed_phase("apply");
+    ok = txn_try([&]() {
+      apply_config(t.cold, t.a, [&](unsigned sub, bool done) {
+        if(sub == sub_net && done) {
+          double ms = ms_since(t0);
+          g_timings.add("net_ready", ms);
+          g_metrics.add("phase:net_ready", ms, false);
+          dbg("Network ready in " << ms << " ms");
+        }
+      });
+    });
+  }
+
+  if(!ok)
+    return 1;
+  mark_boot(t.stnm, t.a.eth);
+  return 0;
+}
+
+typedef enum { commited, rejected } conf_t;
+
+volatile bool sigint = false;
+volatile bool sigusr1 = false;
+
+/* Deadline wait_ms milliseconds from now */
+struct timespec deadline_in(long wait_ms) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  t.tv_sec += wait_ms / 1000;
+  t.tv_nsec += (wait_ms % 1000) * 1000000L;
+  if(t.tv_nsec >= 1000000000L) {
+    t.tv_sec++;
+    t.tv_nsec -= 1000000000L;
+  }
+  return t;
+}
+
+/* Time left until the deadline, zero if it has passed */
+struct timespec time_left(const struct timespec &deadline) {
+  struct timespec now, r;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  r.tv_sec = deadline.tv_sec - now.tv_sec;
+  r.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+  if(r.tv_nsec < 0) {
+    r.tv_sec--;
+    r.tv_nsec += 1000000000L;
+  }
+  if(r.tv_sec < 0)
+    r.tv_sec = r.tv_nsec = 0;
+  return r;
+}
+
+/* Waits for SIGUSR1 (commit) or SIGINT/SIGHUP (rollback) on a signalfd, so
+ * the decision is noticed as soon as it is sent */
+conf_t wait_commit(const args &a) {
 
+  {
+    struct sigaction s;
+    memset(&s, 0, sizeof(struct sigaction));
+    s.sa_handler = [](int signo) -> void { sigusr1 = true; };
+    sigemptyset(&s.sa_mask);
+    s.sa_flags = 0;
+    throw_if( 0 != sigaction(SIGUSR1, &s, NULL));
+  }
 
-    string line;
-    while(getline(fs, line)) {
+  /* Block before publishing the pid, the signals are then only delivered
+   * through the signalfd */
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGHUP);
+  throw_if( 0 != sigprocmask(SIG_BLOCK, &set, &old) );
+  atret( sigprocmask(SIG_SETMASK, &old, NULL) );
+
+  int sfd = signalfd(-1, &set, SFD_CLOEXEC);
+  throw_if(sfd < 0);
+  atret( close(sfd) );
+
+  /* Published by rename, readers never see a partially written file */
+  const string pidnm = SETMAN_PIDFILE + a.scope;
+  fstream pidf(pidnm + ".tmp", ios_base::out);
+  atret( remove(pidnm.c_str()); );
 
-      dbg("Command" << (mode == dryrun ? " (dryrun): " : ": ") << line );
+  pidf << getpid();
+  pidf.close();
+  throw_if( pidf.fail() );
+  throw_if( 0 != rename((pidnm + ".tmp").c_str(), pidnm.c_str()) );
 
-      string cmd;
-      istringstream s(line);
+  cout << pidnm << endl;
 
-      throw_if_not( s >> cmd );
+  struct timespec deadline = deadline_in(a.wait_ms);
 
-      if(chk(cmd, s))
-        continue;
-      else if (confirm_chk(cmd, s))
-        continue;
-      else  {
-        throw_("Invalid command '" << cmd << "'");
-      }
+  while(!sigint && !sigusr1) {
+    struct timespec left = time_left(deadline);
+    struct pollfd pfd = { sfd, POLLIN, 0 };
+    int ret = ppoll(&pfd, 1, &left, NULL);
+    if(ret < 0 && errno == EINTR)
+      continue;
+    throw_if(ret < 0);
+    if(ret == 0) {
+      dbg("Timeout");
+      break;
     }
 
-  });
+    struct signalfd_siginfo si;
+    if(read(sfd, &si, sizeof(si)) != sizeof(si))
+      continue;
+    if(si.ssi_signo == SIGUSR1)
+      sigusr1 = true;
+    else {
+      dbg("Interruped: signal " << si.ssi_signo);
+      sigint = true;
+    }
+  }
 
-  });
+  return sigusr1 ? commited : rejected;
+}
 
-  throw_if_not(confirmed);
+/* Parses -w argument: seconds, possibly fractional, or milliseconds with
+ * the 'ms' suffix */
+long parse_wait(const string &s) {
+  size_t pos = 0;
+  if(s.size() > 2 && s.compare(s.size() - 2, 2, "ms") == 0) {
+    long ms = stol(s.substr(0, s.size() - 2), &pos);
+    throw_if(pos != s.size() - 2 || ms < 0);
+    return ms;
+  }
+  double sec = stod(s, &pos);
+  throw_if(pos != s.size() || sec < 0);
+  return (long)(sec * 1000 + 0.5);
 }
 
-void apply_state_net(istream &fs, const args &a, cmdmode_t mode) {
-  apply_state_1(with_ip, fs, a, mode);
+/* Subsystems covered by the mode ("" or ".all", ".net", ...) */
+unsigned mode_subsys(const string &mode) {
+  if(mode == ".serial")
+    return sub_serial;
+  else if (mode == ".user")
+    return sub_user;
+  else if (mode == ".net")
+    return sub_net;
+  else if (mode == ".syslog")
+    return sub_syslog;
+  else if (mode == ".time")
+    return sub_time;
+  else if (mode == ".all" || mode == "")
+    return sub_all;
+  throw_("Invalid mode " << mode);
 }
 
-void apply_state_serial(istream &fs, const args &a, cmdmode_t mode) {
-  apply_state_1(with_serial, fs, a, mode);
+/* Suffix of the state, lock and pid files of an interface configured by a
+ * multi-interface apply (see apply_multi). Network settings belong to an
+ * interface, so in net mode each of them has its own files there */
+string iface_scope(unsigned msubsys, const string &eth) {
+  return (msubsys == sub_net && !eth.empty()) ? "@" + eth : "";
 }
 
-void apply_state_user(istream &fs, const args &a, cmdmode_t mode) {
-  apply_state_1(with_user, fs, a, mode);
+/* Scope of a run on one interface: the interface's own files if a
+ * multi-interface apply created them, the unscoped ones otherwise */
+string find_scope(const string &mode, unsigned msubsys, const string &eth) {
+  string sc = iface_scope(msubsys, eth);
+  if(sc.empty())
+    return sc;
+  string st = SETMAN_STATE + mode + sc;
+  if(0 == access(st.c_str(), F_OK) || 0 == access((st + ".journal").c_str(), F_OK))
+    return sc;
+  return "";
 }
 
-void apply_state_syslog(istream &fs, const args &a, cmdmode_t mode) {
-  apply_state_1(with_syslog, fs, a, mode);
+/*
+ * Daemon mode. A long running setman holds the locks and the committed
+ * states in memory and serves the command line verbs on SETMAN_SOCKET.
+ *
+ * Request:  "VERB MODE ETH FORCE FULL WAIT_MS\n", followed by the command file
+ *           for 'apply'. The client then shuts down its sending side.
+ * Response: "EXITCODE\n", followed by a message for the user.
+ *
+ * Empty MODE and ETH are sent as '-'.
+ */
+
+static string dash(const string &s) { return s.empty() ? "-" : s; }
+static string undash(const string &s) { return s == "-" ? "" : s; }
+
+static bool sendall(int fd, const string &data) {
+  size_t off = 0;
+  while(off < data.size()) {
+    ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return false;
+    off += n;
+  }
+  return true;
 }
 
-void apply_state_time(istream &fs, const args &a, cmdmode_t mode) {
-  apply_state_1(with_time, fs, a, mode);
+static void sockaddr_of(struct sockaddr_un &sa, const string &path) {
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  throw_if(path.size() >= sizeof(sa.sun_path));
+  strcpy(sa.sun_path, path.c_str());
 }
 
-bool try_lockfile(guard &g, const string &lf) {
-  int lockfd = open ( lf.c_str(), O_RDONLY | O_NOCTTY | O_NOFOLLOW | O_CREAT | O_CLOEXEC, 0666 );
-  throw_if(lockfd < 0);
-  if( 0 != flock(lockfd, LOCK_EX | LOCK_NB )) {
-    close(lockfd);
-    return false;
-  }
-  else {
-    g.next( [=]() { close(lockfd); } );
-    g.next( [=]() { dbg("Unlocking"); flock(lockfd, LOCK_UN); } );
-    return true;
+/* Connect to the daemon, -1 if there is none */
+int client_connect() {
+  struct sockaddr_un sa;
+  sockaddr_of(sa, SETMAN_SOCKET);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  throw_if(fd < 0);
+  if(0 != connect(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+    close(fd);
+    return -1;
   }
+  return fd;
 }
 
-void lockfile(guard &g, const string &lf) {
-  const int attempts=3;
-  for(int i=0; i<attempts; i++) {
-    if(try_lockfile(g,lf))
-      return;
-    err("Waiting for lockfile '" << lf << "'. (" << i << " attempts of " << attempts << ")");
-    sleep(1);
+/* Send the request over fd (consumed) and wait for the response */
+int client_call(int fd, const string &verb, const string &mode, const args &a,
+                const string &body, string &msg) {
+  atret( close(fd) );
+  string req = ss(verb << " " << dash(mode) << " " << dash(a.eth) << " "
+                  << a.force << " " << a.full << " " << a.wait_ms << "\n");
+  throw_if_not( sendall(fd, req + body) );
+  shutdown(fd, SHUT_WR);
+
+  string resp;
+  char buf[4096];
+  for(;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if(n < 0 && errno == EINTR)
+      continue;
+    throw_if(n < 0);
+    if(n == 0)
+      break;
+    resp.append(buf, n);
   }
-  throw_("Failed to lock the lockfile '" << lf << "'");
+
+  istringstream s(resp);
+  int exitcode;
+  throw_if_not( s >> exitcode );
+  s.get();
+  msg.assign(istreambuf_iterator<char>(s), istreambuf_iterator<char>());
+  return exitcode;
 }
 
-typedef enum { commited, rejected } conf_t;
+struct daemon_t {
+  daemon_t() : pending_fd(-1) {}
 
-volatile bool sigint = false;
-volatile bool sigusr1 = false;
+  guard locks;
+  map<string, bool> locked;               /* by mode and scope */
+  map<string, config_t> committed;        /* by state file */
 
-conf_t wait_commit(const args &a) {
+  unique_ptr<txn_t> pending;              /* applied, waiting for commit */
+  int pending_fd;                         /* client of the pending apply */
+  struct timespec deadline;
 
-  fstream pidf(SETMAN_PIDFILE, ios_base::out);
-  atret( remove(SETMAN_PIDFILE); );
-  
-  pidf << getpid();
-  pidf.close();
-  throw_if( pidf.fail() );
+  void reply(int fd, int exitcode, const string &msg) {
+    if(!sendall(fd, ss(exitcode << "\n" << msg)))
+      err("Failed to reply to a client");
+    close(fd);
+  }
 
-  {
-    struct sigaction s;
-    memset(&s, 0, sizeof(struct sigaction));
-    s.sa_handler = [](int signo) -> void { sigusr1 = true; };
-    sigemptyset(&s.sa_mask);
-    s.sa_flags = 0;
-    throw_if( 0 != sigaction(SIGUSR1, &s, NULL));
+  /* Commit or roll back the pending transaction */
+  void finish(bool commit) {
+    txn_t &t = *pending;
+    bool ok = false;
+    if(commit) {
+      dbg("Confirming");
+      ok = txn_commit(t);
+    }
+    else {
+      dbg("Discarding");
+    }
+
+    if(ok) {
+      committed[t.stnm] = t.cnew;
+    }
+    else {
+      txn_try([&]() { txn_rollback(t); });
+    }
+
+    reply(pending_fd, ok ? 0 : 1, "");
+    pending_fd = -1;
+    pending.reset();
   }
 
-  cout << SETMAN_PIDFILE << endl;
+  void handle(int fd, const string &req) {
+    istringstream s(req);
+    string verb, mode, eth;
+    args a;
+    throw_if_not( s >> verb >> mode >> eth >> a.force >> a.full >> a.wait_ms );
+    s.get();
+    mode = undash(mode);
+    a.eth = undash(eth);
+    unsigned msubsys = mode_subsys(mode);
+    a.scope = find_scope(mode, msubsys, a.eth);
+
+    dbg("Request " << verb << " mode '" << mode << "' eth '" << a.eth << "'");
+
+    if(verb == "apply") {
+      if(pending) {
+        reply(fd, 2, "Busy: another change is waiting for commit decision\n");
+        return;
+      }
+
+      if(!locked[mode + a.scope]) {
+        lockfile(locks, SETMAN_LOCKFILE + mode + a.scope, a.lock_ms);
+        locked[mode + a.scope] = true;
+        txn_recover(mode, msubsys, a);
+      }
+
+      throw_if( a.eth.length() == 0 );
 
-  int s;
-  for(s=0; s<a.wait_sec && !sigint && !sigusr1 ; s++) {
-    int ret = sleep(1);
-    if(ret != 0) {
-      dbg("Interruped: ret " << ret);
-      break;
+      unique_ptr<txn_t> t(new txn_t(mode, msubsys, a));
+      txn_stage(*t, s);
+      auto c = committed.find(t->stnm);
+      txn_prepare(*t, c == committed.end() ? NULL : &c->second);
+
+      pending = move(t);
+      pending_fd = fd;
+
+      if(!txn_apply(*pending)) {
+        finish(false);
+      }
+      else if(a.force) {
+        dbg("Forcing");
+        finish(true);
+      }
+      else {
+        deadline = deadline_in(a.wait_ms);
+      }
+    }
+    else if(verb == "commit" || verb == "rollback") {
+      if(!pending) {
+        reply(fd, 2, "No changes are waiting for commit decision\n");
+        return;
+      }
+      finish(verb == "commit");
+      reply(fd, 0, "");
+    }
+    else if(verb == "status") {
+      if(pending && pending->mode == mode)
+        reply(fd, 1, ss("Setman process " << getpid() << " was waiting for commit decision at the moment of status call\n"));
+      else
+        reply(fd, 0, "Setman is ready for commands\n");
+    }
+    else {
+      throw_("Invalid request '" << verb << "'");
     }
   }
 
-  if(sigusr1)
-    return commited;
-  else {
-    if(s == a.wait_sec) {
-      dbg("Timeout");
+  void run() {
+    struct sockaddr_un sa;
+    sockaddr_of(sa, SETMAN_SOCKET);
+
+    int fd = client_connect();
+    if(fd >= 0) {
+      close(fd);
+      throw_("Another daemon is serving " << SETMAN_SOCKET);
+    }
+    remove(SETMAN_SOCKET);
+
+    int ls = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    throw_if(ls < 0);
+    atret( close(ls) );
+    throw_if( 0 != bind(ls, (struct sockaddr*)&sa, sizeof(sa)) );
+    atret( remove(SETMAN_SOCKET) );
+    throw_if( 0 != chmod(SETMAN_SOCKET, 0600) );
+    throw_if( 0 != listen(ls, 16) );
+
+    dbg("Serving " << SETMAN_SOCKET);
+
+    map<int, string> clients;   /* requests being received */
+    atret(
+      for(auto &c : clients)
+        close(c.first);
+      if(pending)
+        finish(false);
+    );
+
+    while(!sigint) {
+      vector<struct pollfd> fds;
+      fds.push_back({ls, POLLIN, 0});
+      for(auto &c : clients)
+        fds.push_back({c.first, POLLIN, 0});
+
+      struct timespec left;
+      if(pending)
+        left = time_left(deadline);
+
+      int ret = ppoll(fds.data(), fds.size(), pending ? &left : NULL, NULL);
+      if(ret < 0 && errno == EINTR)
+        continue;
+      throw_if(ret < 0);
+
+      if(pending && ret == 0) {
+        dbg("Timeout");
+        finish(false);
+        continue;
+      }
+
+      if(fds[0].revents & POLLIN) {
+        int cfd = accept4(ls, NULL, NULL, SOCK_CLOEXEC);
+        if(cfd >= 0)
+          clients[cfd] = string();
+      }
+
+      for(size_t i = 1; i < fds.size(); i++) {
+        if(fds[i].revents == 0)
+          continue;
+        int cfd = fds[i].fd;
+        char buf[4096];
+        ssize_t n = read(cfd, buf, sizeof(buf));
+        if(n > 0) {
+          clients[cfd].append(buf, n);
+          continue;
+        }
+        if(n < 0 && errno == EINTR)
+          continue;
+
+        string req = clients[cfd];
+        clients.erase(cfd);
+        if(n < 0) {
+          close(cfd);
+          continue;
+        }
+
+        try {
+          handle(cfd, req);
+        }
+        catch(string &e) {
+          err("Exception: " << e);
+          reply(cfd, 2, e + "\n");
+        }
+        catch(exception &e) {
+          err("Exception: " << e.what());
+          reply(cfd, 2, string(e.what()) + "\n");
+        }
+        g_metrics.flush();
+      }
     }
-    return rejected;
+
+    dbg("Exiting");
   }
-}
+};
 
 void usage()  {
   cerr << endl;
   cerr << "Setman reset default system settings and/or applies new one" << endl << endl;
-  cerr << "Usage: setman -e ETH [-w SEC] [-f] [-m mode] [-q] (-s|-c|-r|(-|FILE))" << endl;
-  cerr << "    -e ETH       Network interface" << endl;
+  cerr << "Usage: setman -e ETH [-w SEC] [--lock-wait SEC] [-f] [--full] [--converge] [-m mode] [-q] (-s|-c|-r|-d|--recover|--restore|(-|FILE))" << endl;
+  cerr << "    -e ETH       Network interface. Repeat -e to configure several interfaces" << endl;
+  cerr << "                 concurrently from 'interface ETH' blocks of FILE (-m net);" << endl;
+  cerr << "                 their state, lock and PID files are per interface (NAME@ETH)," << endl;
+  cerr << "                 '-c -e ETH' and '-r -e ETH' then decide on one of them" << endl;
   cerr << "    -w SEC       Wait SEC seconds for confirmation" << endl;
+  cerr << "                 (fractions like 0.25 or milliseconds like 250ms are accepted)" << endl;
   cerr << "                 (Default: " << DEFAULT_WAIT << " secons)" << endl;
+  cerr << "    --lock-wait SEC  Wait SEC seconds for the lock file (same format as -w)" << endl;
+  cerr << "                 (Default: " << DEFAULT_LOCK_WAIT << " seconds)" << endl;
   cerr << "    -f           Force applying, don't wait for confirmation" << endl;
+  cerr << "    --full       Re-apply all settings, not only the changed ones" << endl;
+  cerr << "    --converge   Compare with the live settings (links, routes, resolv.conf," << endl;
+  cerr << "                 firewall, syslogd) and only change what differs" << endl;
   cerr << "    -c|--commit  Commit uncommited changes" << endl;
   cerr << "    -r|--rollback  Rollback uncommited changes" << endl;
   cerr << "    -s|--status  Print status (exitcode is 0 if ready for commits, 1 otherwise)" << endl;
+  cerr << "    --metrics    With -s, print command, handler and phase latency metrics" << endl;
+  cerr << "    -d|--daemon  Serve requests on " << SETMAN_SOCKET << " until SIGINT" << endl;
+  cerr << "                 Other invocations forward their request to it when it runs" << endl;
+  cerr << "    --recover    Finish or undo a change interrupted by a crash, which" << endl;
+  cerr << "                 is otherwise done before the next change (safe at boot)" << endl;
+  cerr << "    --restore    Apply the committed state at boot, without staging or" << endl;
+  cerr << "                 comparing it; reports the time until the network is ready" << endl;
   cerr << "    -q           Be quiet (almost)" << endl;
+  cerr << "    -v           Also log every command and the output of the tools" << endl;
   cerr << "    -m mode      Operate on a subset of settings" << endl;
   cerr << "                 mode is one of (net,serial,syslog,all,user,time)" << endl;
   cerr << "                 default is 'all'" << endl;
   cerr << "    --stress-sleep SEC  emulate delay for SEC seconds" << endl;
+  cerr << "    --timings FILE  Append phase timings (ms) of this run to FILE as JSON" << endl;
   cerr << "    FILE         New command file" << endl;
   cerr << "Signals:" << endl;
   cerr << "         SIGUSR1 Confirm the changes" << endl;
   cerr << "Files:" << endl;
-  cerr << "         PID file:   " << SETMAN_PIDFILE << endl;
-  cerr << "         State:      " << SETMAN_STATE << "[.mode]" << endl;
-  cerr << "         Lock file:  " << SETMAN_LOCKFILE << " (access via flock)" << endl;
+  cerr << "         PID file:   " << SETMAN_PIDFILE << "[@ETH]" << endl;
+  cerr << "         State:      " << SETMAN_STATE << "[.mode][@ETH]" << endl;
+  cerr << "                     (and its compiled form, <state>.bin)" << endl;
+  cerr << "         Lock file:  " << SETMAN_LOCKFILE << "[.mode][@ETH] (access via flock)" << endl;
+  cerr << "         Socket:     " << SETMAN_SOCKET << " (daemon mode)" << endl;
+  cerr << "         Metrics:    " << SETMAN_METRICS << endl;
   exit(3);
 }
 
-typedef enum {commit, rollback, apply, status} act_t;
+/* The command file, '-' is stdin. The file is removed when g is done */
+istream &open_source(guard &g, const string &fname, ifstream &f) {
+  if(fname == "-")
+    return cin;
+  g.next( [=]() { dbg("Removing " << fname); remove(fname.c_str()); } );
+  f.open(fname, ios::binary);
+  throw_if(!f);
+  return f;
+}
+
+/* Applies the staged file and waits for the commit decision, returns the
+ * exit code. The caller holds the lock */
+int apply_one(txn_t &t, size_t dbgsleep) {
+
+  const args &a = t.a;
+  txn_prepare(t);
+
+  if(dbgsleep>0) {
+    dbg("Going to sleep for " << dbgsleep << " seconds");
+    sleep(dbgsleep);
+  }
+
+  bool ok = txn_apply(t);
+
+  if(ok) {
+    if(a.force) {
+      dbg("Forcing");
+      ok = txn_commit(t);
+    }
+    else {
+      bool c = false;
+      ok = txn_try([&]() { timed_phase("wait"); c = (wait_commit(a) == commited); });
+
+      if(ok && c) {
+        dbg("Confirming");
+        ok = txn_commit(t);
+      }
+      else {
+        dbg("Discarding");
+        ok = false;
+      }
+    }
+  }
+
+  if(!ok) {
+    txn_rollback(t);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Several interfaces in one go: src holds an 'interface ETH' block of net
+ * commands for each of them. Every interface is applied by a child of its
+ * own, with its own lock, state and pid file, so they are configured
+ * concurrently and committed or rolled back independently ('-c -e ETH').
+ */
+int apply_multi(const vector<string> &ifaces, const args &a, const string &mode, istream &src) {
+  throw_if( mode_subsys(mode) != sub_net );
+
+  map<string, string> blocks;
+  string line, cur;
+  while(getline(src, line)) {
+    istringstream l(line);
+    string cmd, eth, e;
+    if(!(l >> cmd))
+      continue;
+    if(cmd == "interface") {
+      throw_if_not( l >> eth );
+      throw_if( l >> e );
+      throw_if( find(ifaces.begin(), ifaces.end(), eth) == ifaces.end() );
+      throw_if( blocks.count(eth) );
+      blocks[eth];
+      cur = eth;
+      continue;
+    }
+    if(cur.empty())
+      throw_("Command '" << cmd << "' outside of an interface block");
+    blocks[cur] += line + "\n";
+  }
+  throw_if( blocks.size() != ifaces.size() );
+
+  cout.flush();
+  cerr.flush();
+
+  map<pid_t, string> children;
+  for(const string &eth : ifaces) {
+    /* The child must not inherit a running drainer (or its lock) */
+    g_logring.flush();
+    pid_t pid = fork();
+    throw_if(pid < 0);
+    if(pid == 0) {
+      int code = 2;
+      try {
+        args ia = a;
+        ia.eth = eth;
+        ia.scope = iface_scope(sub_net, eth);
+        guard g;
+        lockfile(g, SETMAN_LOCKFILE + mode + ia.scope, ia.lock_ms);
+        txn_recover(mode, sub_net, ia);
+        istringstream in(blocks[eth]);
+        txn_t t(mode, sub_net, ia);
+        txn_stage(t, in);
+        code = apply_one(t, 0);
+      }
+      catch(string &e) {
+        err("Exception: " << e);
+      }
+      catch(exception &e) {
+        err("Exception: " << e.what());
+      }
+      g_metrics.flush();
+      g_logring.flush();
+      cout.flush();
+      _exit(code);
+    }
+    dbg("Applying " << eth << " in process " << pid);
+    children[pid] = eth;
+  }
+
+  int exitcode = 0;
+  while(!children.empty()) {
+    int st;
+    pid_t pid = waitpid(-1, &st, 0);
+    if(pid < 0 && errno == EINTR)
+      continue;
+    throw_if(pid < 0);
+    if(!children.count(pid))
+      continue;
+    int code = WIFEXITED(st) ? WEXITSTATUS(st) : 2;
+    dbg("Interface " << children[pid] << " done, exit code " << code);
+    exitcode = max(exitcode, code);
+    children.erase(pid);
+  }
+  return exitcode;
+}
+
+typedef enum {commit, rollback, apply, status, serve, recover, restore} act_t;
 
 int main(int argc, char **argv) {
 
   int exitcode = 2;
   bool show_usage = true;
   bool quiet = false;
+  bool metrics = false;
+  string timings;
+  act_t act = apply;
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
 
   /* For debugging */
   size_t dbgsleep = 0;
@@ -673,20 +4153,32 @@ int main(int argc, char **argv) {
 
     string fname;
     string mode;
-    act_t act = apply;
+    vector<string> ifaces;
 
     for(int i=1; i< argc; i++) {
       if(string(argv[i]) == "-e") {
         throw_if(++i >= argc);
         a.eth = string(argv[i]);
+        if(find(ifaces.begin(), ifaces.end(), a.eth) == ifaces.end())
+          ifaces.push_back(a.eth);
       }
       else if(string(argv[i]) == "-w") {
         throw_if(++i >= argc);
-        a.wait_sec = stoi(string(argv[i]));
+        a.wait_ms = parse_wait(string(argv[i]));
+      }
+      else if(string(argv[i]) == "--lock-wait") {
+        throw_if(++i >= argc);
+        a.lock_ms = parse_wait(string(argv[i]));
       }
       else if(string(argv[i]) == "-f") {
         a.force = true;
       }
+      else if(string(argv[i]) == "--full") {
+        a.full = true;
+      }
+      else if(string(argv[i]) == "--converge") {
+        a.converge = true;
+      }
       else if(string(argv[i]) == "-h" || string(argv[i]) == "--help") {
         usage();
       }
@@ -707,9 +4199,28 @@ int main(int argc, char **argv) {
       else if(string(argv[i]) == "-s" || string(argv[i]) == "--status") {
         act = status;
       }
+      else if(string(argv[i]) == "-d" || string(argv[i]) == "--daemon") {
+        act = serve;
+      }
+      else if(string(argv[i]) == "--recover") {
+        act = recover;
+      }
+      else if(string(argv[i]) == "--restore") {
+        act = restore;
+      }
       else if(string(argv[i]) == "-q" || string(argv[i]) == "--quiet") {
         quiet = true;
       }
+      else if(string(argv[i]) == "-v" || string(argv[i]) == "--verbose") {
+        g_loglevel = LOG_DEBUG;
+      }
+      else if(string(argv[i]) == "--metrics") {
+        metrics = true;
+      }
+      else if(string(argv[i]) == "--timings") {
+        throw_if(++i >= argc);
+        timings = string(argv[i]);
+      }
       else if(string(argv[i]) == "--stress-sleep") {
         throw_if(++i >= argc);
         dbgsleep = stoi(argv[i]);
@@ -719,31 +4230,9 @@ int main(int argc, char **argv) {
       }
     }
 
-    fapplier_t apply_state = apply_state_all;
-
-    if(mode == ".serial") {
-      apply_state = apply_state_serial;
-    }
-    else if (mode == ".user") {
-      apply_state = apply_state_user;
-    }
-    else if (mode == ".net") {
-      apply_state = apply_state_net;
-    }
-    else if (mode == ".syslog") {
-      // apply_state = bind(apply_state_1<with_syslog>, with_syslog, _1, _2, _3);
-      apply_state = apply_state_syslog;
-    }
-    else if (mode == ".time") {
-      apply_state = apply_state_time;
-    }
-    else if (mode == ".all" || mode == "") {
-      apply_state = apply_state_all;
+    unsigned msubsys = mode_subsys(mode);
+    if(msubsys == sub_all)
       g_dmode = "all";
-    }
-    else {
-      throw_("Invalid mode " << mode);
-    }
 
     openlog("setman", (quiet ? 0 : LOG_PERROR)|LOG_PID|LOG_NDELAY, LOG_NOTICE);
     g_haslog = true;
@@ -751,146 +4240,82 @@ int main(int argc, char **argv) {
 
     guard g;
 
-    switch(act) {
-      case apply: {
-
-        /* Ugly, but safe */
-        show_usage = false;
-        lockfile(g, SETMAN_LOCKFILE + mode);
-        show_usage = true;
-        
-        string stnm = SETMAN_STATE + mode;
-        string tmpnm = stnm + ".new";
-        bool tmpdead = true;
+    /* Thin client mode: forward the request to the daemon, if it runs */
+    int dfd = (act == serve || act == recover || act == restore || a.converge || metrics || ifaces.size() > 1) ? -1 : client_connect();
+    if(dfd >= 0) {
+      show_usage = false;
+      string body;
 
+      if(act == apply) {
         if(a.eth.length() == 0) {
           const char *eth = getenv("ETH");
           throw_if(eth == NULL);
           a.eth = eth;
         }
 
-        throw_if( a.eth.length() == 0 );
-
         if(fname == "-") {
-          fstream tmps(tmpnm, ios_base::out);
-          throw_if(!tmps);
-          tmpdead = false;
-          g.next([&]() { if(!tmpdead) { dbg("Removing " << tmpnm); remove(tmpnm.c_str()); } });
-
-          string line;
-          while(getline(cin, line)) {
-            throw_if_not( tmps << line << endl );
-          }
-
-          tmps.close();
-
-          throw_if(!cin.eof());
-          throw_if(!tmps);
-          fname = tmpnm;
+          body.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
         }
         else {
           string f = fname;
           atret( dbg("Removing " << f); remove(f.c_str()); );
           ifstream src(fname, ios::binary);
           throw_if(!src);
-          ofstream dest(tmpnm, ios::binary);
-          throw_if(!dest);
-          tmpdead = false;
-          g.next([&]() { if(!tmpdead) { dbg("Removing " << tmpnm); remove(tmpnm.c_str()); } });
-          dbg("Copying from " << fname << " to " << tmpnm);
-          dest << src.rdbuf();
-          src.close();
-          dest.close();
-          fname = tmpnm;
+          body.assign(istreambuf_iterator<char>(src), istreambuf_iterator<char>());
         }
+      }
+      else {
+        throw_if( fname != "" );
+      }
 
-        show_usage = false;
-
-        dbg("fname " << fname);
-        dbg("stnm " << stnm);
-        bool stnm_checked = false;
+      static const char *verbs[] = { "commit", "rollback", "apply", "status" };
+      string msg;
+      exitcode = client_call(dfd, verbs[act], mode, a, body, msg);
+      if(!quiet)
+        cout << msg;
+    }
+    else switch(act) {
+      case apply: {
 
-        {
-          dbg("Checking syntax of " << fname);
-          fstream fs(fname, ios_base::in);
-          throw_if(!fs);
-          apply_state(fs, a, dryrun);
-
-          dbg("Checking sysntax of  " << stnm);
-          fstream f(stnm, ios_base::in);
-          if(f) {
-            apply_state(f, a, dryrun);
-            stnm_checked = true;
-          }
-          else {
-            dbg("Warning: state " << stnm << " doesn't exist, ignoring");
-          }
+        if(a.eth.length() == 0) {
+          const char *eth = getenv("ETH");
+          throw_if(eth == NULL);
+          a.eth = eth;
         }
 
-        bool restore = true;
+        throw_if( a.eth.length() == 0 );
 
-        if(dbgsleep>0) {
-          dbg("Going to sleep for " << dbgsleep << " seconds");
-          sleep(dbgsleep);
+        if(ifaces.size() > 1) {
+          show_usage = false;
+          ifstream f;
+          exitcode = apply_multi(ifaces, a, mode, open_source(g, fname, f));
+          break;
         }
 
-        try {
-
-          fstream fs(fname, ios_base::in);
-          apply_state(fs, a, force);
-
-          if(a.force) {
-
-            dbg("Forcing");
-            throw_if( 0 != rename(fname.c_str(), stnm.c_str()) );
-            tmpdead = true;
-            restore = false;
-
-          }
-          else {
-
-            conf_t c = wait_commit(a);
-
-            switch(c) {
+        a.scope = find_scope(mode, msubsys, a.eth);
 
-              case commited:
-                dbg("Confirming");
-                throw_if( 0 != rename(fname.c_str(), stnm.c_str()) );
-                tmpdead = true;
-                restore = false;
-                break;
-
-              default:
-                dbg("Discarding");
-                break;
-            }
-          }
-        }
-        catch(string &e) {
-          dbg("Exception: " << e);
-        }
-        catch(exception &e) {
-          dbg("Exception: " << e.what());
+        /* Ugly, but safe */
+        show_usage = false;
+        {
+          timed_phase("lock");
+          lockfile(g, SETMAN_LOCKFILE + mode + a.scope, a.lock_ms);
         }
+        txn_recover(mode, msubsys, a);
+        show_usage = true;
 
-        if(restore) {
-          dbg("Rolling back");
-          if(stnm_checked) {
-            fstream f(stnm.c_str(), ios_base::in);
-            apply_state(f, a, force);
-          }
-          else {
-            dbg("Applying null state");
-            istringstream nullconfig("confirm\n");
-            apply_state(nullconfig, a, force);
-          }
-
-          exitcode = 1;
+        int fd = 0;
+        if(fname != "-") {
+          string f = fname;
+          g.next( [=]() { dbg("Removing " << f); remove(f.c_str()); } );
+          fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+          throw_if(fd < 0);
         }
-        else {
+        atret( if(fd > 0) close(fd) );
 
-          exitcode = 0;
-        }
+        show_usage = false;
+        txn_t t(mode, msubsys, a);
+        txn_stage_fd(t, fd, fname == "-" ? string() : fname);
+        exitcode = apply_one(t, dbgsleep);
         break;
       }
 
@@ -903,11 +4328,25 @@ int main(int argc, char **argv) {
         }
 
         throw_if( fname != "" );
-        throw_if( a.eth != "" );
+        throw_if( ifaces.size() > 1 );
 
         show_usage = false;
 
-        fstream pidf(SETMAN_PIDFILE, ios_base::in);
+        /* -e selects the change of one interface of a multi-interface
+         * apply (see apply_multi), if there is one waiting. Without -e the
+         * only waiting interface is taken */
+        string pidnm = SETMAN_PIDFILE;
+        if(!a.eth.empty()) {
+          if(0 == access((pidnm + "@" + a.eth).c_str(), F_OK))
+            pidnm += "@" + a.eth;
+        }
+        else if(0 != access(pidnm.c_str(), F_OK)) {
+          glob_t gl;
+          if(0 == glob((pidnm + "@*").c_str(), 0, NULL, &gl) && gl.gl_pathc == 1)
+            pidnm = gl.gl_pathv[0];
+          globfree(&gl);
+        }
+        fstream pidf(pidnm, ios_base::in);
         int pid;
         throw_if_not( pidf >> pid );
         int ret = kill(pid, act == commit ? SIGUSR1 : SIGINT);
@@ -919,18 +4358,47 @@ int main(int argc, char **argv) {
       case status: {
 
         throw_if( fname != "" );
-        throw_if( a.eth != "" );
+        throw_if( ifaces.size() > 1 );
 
         show_usage = false;
 
-        if (try_lockfile(g, SETMAN_LOCKFILE + mode) ) {
+        if(metrics) {
+          dump_metrics(cout);
+          exitcode = 0;
+          break;
+        }
+
+        /* The unscoped files and, in net mode, those of the interfaces of
+         * multi-interface applies (of ETH only, with -e) */
+        vector<string> scopes(1, "");
+        if(msubsys == sub_net) {
+          string prefix = SETMAN_LOCKFILE + mode;
+          glob_t gl;
+          if(0 == glob((prefix + "@" + (a.eth.empty() ? "*" : a.eth)).c_str(), 0, NULL, &gl)) {
+            for(size_t i = 0; i < gl.gl_pathc; i++)
+              scopes.push_back(string(gl.gl_pathv[i]).substr(prefix.size()));
+          }
+          globfree(&gl);
+        }
+
+        bool busy = false;
+        for(const string &sc : scopes) {
+          guard lg;
+          if(!try_lockfile(lg, SETMAN_LOCKFILE + mode + sc)) {
+            a.scope = sc;
+            busy = true;
+            break;
+          }
+        }
+
+        if (!busy) {
           if(!quiet)
             cout << "Setman is ready for commands" << endl;
           exitcode = 0;
         }
         else {
           try {
-            fstream pidf(SETMAN_PIDFILE, ios_base::in);
+            fstream pidf(SETMAN_PIDFILE + a.scope, ios_base::in);
             int pid;
             throw_if_not( pidf >> pid );
             if(!quiet)
@@ -946,6 +4414,53 @@ int main(int argc, char **argv) {
         break;
       }
 
+      case recover: {
+
+        throw_if( fname != "" );
+        throw_if( ifaces.size() > 1 );
+
+        show_usage = false;
+        a.scope = find_scope(mode, msubsys, a.eth);
+        lockfile(g, SETMAN_LOCKFILE + mode + a.scope, a.lock_ms);
+        if(!txn_recover(mode, msubsys, a))
+          dbg("Nothing to recover");
+        exitcode = 0;
+        break;
+      }
+
+      case restore: {
+
+        throw_if( fname != "" );
+        throw_if( ifaces.size() > 1 );
+
+        if(a.eth.length() == 0) {
+          const char *eth = getenv("ETH");
+          throw_if(eth == NULL);
+          a.eth = eth;
+        }
+
+        show_usage = false;
+        a.scope = find_scope(mode, msubsys, a.eth);
+        {
+          timed_phase("lock");
+          lockfile(g, SETMAN_LOCKFILE + mode + a.scope, a.lock_ms);
+        }
+        txn_recover(mode, msubsys, a);
+        exitcode = txn_restore(mode, msubsys, a, t0);
+        break;
+      }
+
+      case serve: {
+
+        throw_if( fname != "" );
+
+        show_usage = false;
+        daemon_t d;
+        d.run();
+        exitcode = 0;
+        break;
+      }
+
       default:
         throw_("Invalid action: " << act);
     }
@@ -961,6 +4476,20 @@ int main(int argc, char **argv) {
     err("Exception unknown");
   }
 
+  {
+    static const char *acts[] = { "commit", "rollback", "apply", "status", "serve", "recover", "restore" };
+    double total = ms_since(t0);
+    g_metrics.add(string("run:") + acts[act], total, exitcode > 1);
+    if(act != status)
+      g_metrics.flush();
+
+    if(!timings.empty()) {
+      g_timings.add("total", total);
+      ofstream f(timings, ios_base::app);
+      f << g_timings.json(acts[act], g_dmode, exitcode) << endl;
+    }
+  }
+
   if(exitcode != 0 && show_usage)
     usage();
 
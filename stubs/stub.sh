@@ -1,21 +1,59 @@
 #!/bin/sh
 
-echo "Stab called: $0 $@"
+echo "Stab called: $0 $@" >&2
 
 case "$1" in
   *dhcp*)
+    pidfile=dhcp.pid
+    release=0
+    while [ $# -gt 0 ]; do
+      [ "$1" = "-p" ] && pidfile=$2
+      [ "$1" = "-R" ] && release=1
+      shift
+    done
     trap "echo SIGHUP" SIGHUP
     trap "echo SIGINT" SIGINT
     trap "echo SIGPIPE" SIGPIPE
 
+    # Simulated udhcpc: publishes its pid in the -p file, releases the lease
+    # on SIGUSR2 (taking STUB_DHCP_RELEASE seconds) and keeps running, exits
+    # on SIGTERM, releasing the lease first when started with -R.
     (
+    release_lease() { echo "Releasing lease"; sleep ${STUB_DHCP_RELEASE:-0.1}; }
+    trap 'release_lease' USR2
+    trap '[ $release = 1 ] && release_lease; kill $child 2>/dev/null; echo "Exiting on SIGTERM"; exit 0' TERM
     echo "Simulating udhcpc daemon"
-    sleep 3
+    sleep ${STUB_DHCP_LIFETIME:-3} &
+    child=$!
+    # A trapped signal interrupts wait, the client keeps running
+    while kill -0 $child 2>/dev/null; do
+      wait $child
+    done
     echo "Exiting form udhcp simulation"
-    ) &
+    ) >>dhcp.log 2>&1 &
+    echo $! > "$pidfile"
     echo "Bootstrap end"
     ;;
 
+  # The last restored ruleset and sets are kept for the save commands
+  *iptables-restore*)
+    echo "Restoring ruleset:" >&2
+    tee iptables.rules
+    ;;
+
+  *iptables-save*)
+    cat iptables.rules 2>/dev/null || printf '*filter\nCOMMIT\n'
+    ;;
+
+  *ipset-restore*)
+    echo "Restoring sets:" >&2
+    tee ipset.sets
+    ;;
+
+  *ipset-save*)
+    cat ipset.sets
+    ;;
+
   *upwd*)
     cat
     echo "Stop applying users"
@@ -6,13 +6,41 @@
 #define SETMAN_STATE "setman.state"
 #define SETMAN_PIDFILE "setman.pid"
 #define SETMAN_DHCPPID "dhcp.pid"
+/* DHCP client teardown: { signal, ms } steps. The next signal is sent if
+ * the client is still running after the given time. The client is started
+ * with -R, so it releases the lease when it exits on SIGTERM */
+#define SETMAN_DHCP_STOP { SIGTERM, 500 }, { SIGKILL, 100 }
+#define SETMAN_SOCKET "setman.sock"
+#define SETMAN_METRICS SETMAN_STATE ".metrics"
+/* Allow lists of at least this many prefixes (after aggregation) are
+ * matched through the SETMAN_IPSET hash set instead of one rule each */
+#define SETMAN_IPSET "setman-allow"
+#define SETMAN_IPSET_MIN 64
 
-#define SETMAN_IFCONFIG "./stubs/stub.sh ifconfig"
-#define SETMAN_IPTABLES "./stubs/stub.sh iptables"
-#define SETMAN_DHCP "./stubs/stub.sh dhcp"
-#define SETMAN_ROUTE "./stubs/stub.sh route"
-#define SETMAN_UPWD "./stubs/stub.sh upwd"
-#define SETMAN_SERIAL "./stubs/stub.sh serial"
-#define SETMAN_SYSLOG "./stubs/stub.sh syslog"
-#define SETMAN_HWCLOCK "./stubs/stub.sh hwclock"
+/* Commands are argv templates: comma-separated words which are passed to
+ * the program as is, never through a shell. Setman appends its own
+ * arguments after the template. */
+/* Network backend: 1 configures links, addresses and routes over rtnetlink
+ * in-process, 0 runs SETMAN_IFCONFIG and SETMAN_ROUTE. The stubs need 0 */
+#define SETMAN_NETLINK 0
+/* User backend: 1 hashes the passwords and rewrites SETMAN_ROOT/etc/passwd
+ * and shadow in-process, 0 feeds 'user pwd' lines to SETMAN_UPWD. The
+ * stubs use a scratch root in the working directory */
+#define SETMAN_USERS_NATIVE 1
+#define SETMAN_ROOT "."
+/* Serial ports: 1 sets them up through termios in-process, 0 runs
+ * SETMAN_SERIAL DEV BAUD FORMAT FLOW. The stubs need 0 */
+#define SETMAN_SERIAL_NATIVE 0
+
+#define SETMAN_IFCONFIG "./stubs/stub.sh", "ifconfig"
+#define SETMAN_IPTABLES_RESTORE "./stubs/stub.sh", "iptables-restore"
+#define SETMAN_IPTABLES_SAVE "./stubs/stub.sh", "iptables-save"
+#define SETMAN_IPSET_RESTORE "./stubs/stub.sh", "ipset-restore"
+#define SETMAN_IPSET_SAVE "./stubs/stub.sh", "ipset-save"
+#define SETMAN_DHCP "./stubs/stub.sh", "dhcp"
+#define SETMAN_ROUTE "./stubs/stub.sh", "route"
+#define SETMAN_UPWD "./stubs/stub.sh", "upwd"
+#define SETMAN_SERIAL "./stubs/stub.sh", "serial"
+#define SETMAN_SYSLOG "./stubs/stub.sh", "syslog"
+#define SETMAN_HWCLOCK "./stubs/stub.sh", "hwclock"
 